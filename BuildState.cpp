@@ -0,0 +1,203 @@
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "CompilerHeaders.h"
+
+/* Changed whenever the code generated for the same source changes, so VM files
+ * written by another version of the compiler are never kept */
+#define BUILD_STATE_VERSION "2"
+
+
+BuildState::BuildState(std::string directory, std::string options) {
+    this->directory = directory;
+    this->options = options;
+}
+
+
+/* Read the state of every file of the last build. If any of it was written by another
+ * version of the compiler or with other options none of the VM files can be kept, so
+ * everything is compiled again. */
+void BuildState::Load() {
+    DIR *dir;
+    struct dirent *stateFile;
+    if ((dir = opendir(directory.c_str())) == nullptr)
+        return; // First build, nothing to load
+
+    while ((stateFile = readdir(dir)) != nullptr) {
+        std::string filename = stateFile->d_name;
+        if (filename.substr(filename.find_last_of(".") + 1) == "state") {
+            ClassState c;
+            if (!ReadClassState(directory + '/' + filename, c)) {
+                classes.clear();
+                break;
+            }
+            classes[filename.substr(0, filename.find_last_of("."))] = c;
+        }
+    }
+    closedir(dir);
+}
+
+
+/* Compile the files of the program in order, restoring the up to date ones. Once
+ * every class is in the program SymbolTable the restored classes that depend on a
+ * changed interface are compiled again. */
+void BuildState::Compile(Parser &parser, std::string path, const std::vector<std::string> &filenames) {
+    std::vector <std::string> restored;
+    for (const std::string &filename: filenames) {
+        std::string filePath = path + '/' + filename + ".jack";
+        std::ifstream source(filePath);
+        std::stringstream text;
+        text << source.rdbuf();
+        sourceHashes[filename] = Hash(text.str());
+
+        struct stat status;
+        std::map<std::string, ClassState>::iterator it = classes.find(filename);
+        if (it != classes.end() && it->second.sourceHash == sourceHashes[filename] &&
+            stat((path + '/' + filename + ".vm").c_str(), &status) == 0) {
+            parser.RestoreClass(filename, filePath, it->second.className, it->second.symbols,
+                                it->second.dependencies, it->second.calledNames);
+            restored.push_back(filename);
+        }
+        else
+            compiled[filename] = parser.CompileClass(filename, filePath);
+    }
+
+    std::unordered_map <std::string, std::string> memberTypes = parser.MemberTypes();
+    for (const std::string &filename: restored) {
+        const ClassState &c = classes[filename];
+        if (DependencyHash(parser, c.className, memberTypes) != c.dependencyHash) {
+            parser.RecompileClass(filename, path + '/' + filename + ".jack", c.className);
+            compiled[filename] = c.className;
+        }
+    }
+}
+
+
+/* Record the state of the files compiled by this build, once their VM files are
+ * written, and forget the files that are no longer part of the program. */
+void BuildState::Save(Parser &parser) {
+    mkdir(directory.c_str(), 0755);
+    std::unordered_map <std::string, std::string> memberTypes = parser.MemberTypes();
+    for (const std::pair<const std::string, std::string> &file: compiled) {
+        ClassState c;
+        c.className = file.second;
+        c.sourceHash = sourceHashes[file.first];
+        c.symbols = parser.ClassSymbols(c.className);
+        c.interfaceHash = InterfaceHash(c.symbols);
+        c.dependencyHash = DependencyHash(parser, c.className, memberTypes);
+        c.dependencies = parser.ClassDependencies(c.className);
+        c.calledNames = parser.ClassCalledNames(c.className);
+        WriteClassState(directory + '/' + file.first + ".state", c);
+    }
+
+    for (const std::pair<const std::string, ClassState> &c: classes) {
+        if (!sourceHashes.count(c.first))
+            std::remove((directory + '/' + c.first + ".state").c_str());
+    }
+}
+
+
+// 64 bit FNV-1a hash, as hexadecimal
+std::string BuildState::Hash(const std::string &text) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (char c: text) {
+        hash ^= (unsigned char)c;
+        hash *= 1099511628211ULL;
+    }
+    std::stringstream hex;
+    hex << std::hex << hash;
+    return hex.str();
+}
+
+
+/* The interface of a class is everything other classes can see of it, the class,
+ * field, static and subroutine entries it has in the program SymbolTable */
+std::string BuildState::InterfaceHash(const std::vector<Symbol> &symbols) {
+    std::stringstream text;
+    for (const Symbol &s: symbols) {
+        text << s.kind << ' ' << s.name << ' ' << s.type;
+        for (const std::string &argument: s.arguments)
+            text << ' ' << argument;
+        text << '\n';
+    }
+    return Hash(text.str());
+}
+
+
+/* What the code generated for a class depends on outside of it, the interfaces of
+ * the classes it references and the types the names it calls resolve to. */
+std::string BuildState::DependencyHash(Parser &parser, const std::string &className,
+                                       const std::unordered_map<std::string, std::string> &memberTypes) {
+    std::stringstream text;
+    for (const std::string &dependency: parser.ClassDependencies(className))
+        text << dependency << ' ' << InterfaceHash(parser.ClassSymbols(dependency)) << '\n';
+    for (const std::string &name: parser.ClassCalledNames(className)) {
+        std::unordered_map<std::string, std::string>::const_iterator it = memberTypes.find(name);
+        text << name << ' ' << (it != memberTypes.end() ? it->second : "") << '\n';
+    }
+    return Hash(text.str());
+}
+
+
+bool BuildState::ReadClassState(std::string filename, ClassState &c) {
+    std::ifstream file(filename);
+    std::string line;
+    if (!std::getline(file, line) || line != "version " BUILD_STATE_VERSION " " + options)
+        return false; // Written by another version of the compiler or with other options
+    while (std::getline(file, line)) {
+        std::stringstream fields(line);
+        std::string key, value;
+        fields >> key;
+        if (key == "class")
+            fields >> c.className;
+        else if (key == "source")
+            fields >> c.sourceHash;
+        else if (key == "interface")
+            fields >> c.interfaceHash;
+        else if (key == "dependency")
+            fields >> c.dependencyHash;
+        else if (key == "depends") {
+            while (fields >> value)
+                c.dependencies.insert(value);
+        }
+        else if (key == "calls") {
+            while (fields >> value)
+                c.calledNames.insert(value);
+        }
+        else if (key == "symbol") {
+            Symbol s;
+            int kind;
+            fields >> kind >> s.name >> s.type >> s.offset >> s.initialised;
+            s.kind = (Symbol::symbolKind)kind;
+            while (fields >> value)
+                s.arguments.push_back(value);
+            c.symbols.push_back(s);
+        }
+    }
+    return !c.className.empty() && !c.symbols.empty();
+}
+
+
+void BuildState::WriteClassState(std::string filename, const ClassState &c) {
+    std::ofstream file(filename);
+    file << "version " BUILD_STATE_VERSION " " << options << '\n'
+         << "class " << c.className << '\n'
+         << "source " << c.sourceHash << '\n'
+         << "interface " << c.interfaceHash << '\n'
+         << "dependency " << c.dependencyHash << '\n'
+         << "depends";
+    for (const std::string &dependency: c.dependencies)
+        file << ' ' << dependency;
+    file << "\ncalls";
+    for (const std::string &name: c.calledNames)
+        file << ' ' << name;
+    file << '\n';
+    for (const Symbol &s: c.symbols) {
+        file << "symbol " << s.kind << ' ' << s.name << ' ' << s.type << ' ' << s.offset << ' ' << s.initialised;
+        for (const std::string &argument: s.arguments)
+            file << ' ' << argument;
+        file << '\n';
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef BUILDSTATE_H
+#define BUILDSTATE_H
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include "SymbolTable.h"
+
+class Parser;
+
+/************** BuildState class definitions **************/
+/* The state of the last build of a program, one file per source file in the build
+ * state directory. A class is compiled again only if its source changed or if the
+ * interface of something it depends on changed, otherwise it is restored. */
+class BuildState {
+public:
+    typedef struct {
+        std::string className;
+        std::string sourceHash;
+        std::string interfaceHash; // Of its entries in the program SymbolTable
+        std::string dependencyHash; // Of the interfaces of what it references
+        std::set <std::string> dependencies;
+        std::set <std::string> calledNames;
+        std::vector <Symbol> symbols;
+    } ClassState;
+
+private:
+    std::string directory;
+    std::string options; // That change the generated code, the VM files depend on them
+    std::map <std::string, ClassState> classes; // Keyed by the file name
+    std::map <std::string, std::string> sourceHashes; // Of the files being compiled
+    std::map <std::string, std::string> compiled; // Files compiled by this build to their class
+
+public:
+    BuildState(std::string directory, std::string options);
+    void Load();
+    void Compile(Parser &parser, std::string path, const std::vector<std::string> &filenames);
+    void Save(Parser &parser);
+
+private:
+    static std::string Hash(const std::string &text);
+    static std::string InterfaceHash(const std::vector<Symbol> &symbols);
+    std::string DependencyHash(Parser &parser, const std::string &className,
+                               const std::unordered_map<std::string, std::string> &memberTypes);
+    bool ReadClassState(std::string filename, ClassState &c);
+    void WriteClassState(std::string filename, const ClassState &c);
+};
+
+#endif
@@ -4,7 +4,19 @@
 #include "Lexer.h"
 #include "Parser.h"
 #include "SymbolTable.h"
+#include "BuildState.h"
+#include "FlowGraph.h"
+#include "VmCode.h"
+#include "Optimiser.h"
 #define NUM_JACK_KEYWORDS 21
 #define NUM_JACK_SYMBOLS 19
+#define MIN_DECLARS_PER_SHARD 4096 // Smallest slice worth checking on its own thread
+/* Longest inline sequence a multiplication by a constant is replaced with, the call
+ * is 2 instructions but Math.multiply loops over all 16 bits */
+#define MULTIPLY_CALL_COST 24
+/* A call and its return translate to about as much as this many other VM instructions,
+ * so inlining a body no longer than it never makes the program bigger */
+#define INLINE_CALL_COST 10
+#define INLINE_MAX_GROWTH 48 // Most instructions inlining one function may add in total
 
 #endif
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include "CompilerHeaders.h"
+
+
+static FlowGraph::BitSet EmptySet(int nVariables) {
+    return FlowGraph::BitSet((nVariables + 63) / 64, 0);
+}
+
+
+static FlowGraph::BitSet FullSet(int nVariables) {
+    return FlowGraph::BitSet((nVariables + 63) / 64, ~0ULL);
+}
+
+
+static bool TestBit(const FlowGraph::BitSet &set, int bit) {
+    return (set[bit / 64] >> (bit % 64)) & 1;
+}
+
+
+static void SetBit(FlowGraph::BitSet &set, int bit) {
+    set[bit / 64] |= 1ULL << (bit % 64);
+}
+
+
+static void ClearBit(FlowGraph::BitSet &set, int bit) {
+    set[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+
+// Start the graph of a new subroutine with just its entry block
+void FlowGraph::Reset() {
+    blocks.clear();
+    current = NewBlock();
+}
+
+
+int FlowGraph::NewBlock() {
+    blocks.push_back(block());
+    return blocks.size() - 1;
+}
+
+
+void FlowGraph::AddEdge(int from, int to) {
+    blocks[from].successors.push_back(to);
+    blocks[to].predecessors.push_back(from);
+}
+
+
+void FlowGraph::Read(int variable, Token t) {
+    access a = {false, variable, t};
+    blocks[current].accesses.push_back(a);
+}
+
+
+void FlowGraph::Write(int variable, Token t) {
+    access a = {true, variable, t};
+    blocks[current].accesses.push_back(a);
+}
+
+
+// The blocks reachable from the entry, each one before its successors except on back edges
+std::vector <int> FlowGraph::ReversePostorder() {
+    std::vector <int> order;
+    std::vector <bool> visited(blocks.size(), false);
+    // Iterative depth first search, the stack holds a block and its next successor
+    std::vector <std::pair<int, unsigned long>> stack;
+    stack.push_back({0, 0});
+    visited[0] = true;
+    while (!stack.empty()) {
+        std::pair <int, unsigned long> &top = stack.back();
+        if (top.second < blocks[top.first].successors.size()) {
+            int next = blocks[top.first].successors[top.second++];
+            if (!visited[next]) {
+                visited[next] = true;
+                stack.push_back({next, 0});
+            }
+        }
+        else {
+            order.push_back(top.first);
+            stack.pop_back();
+        }
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+
+/* Worklist solver, the blocks are visited in reverse postorder (postorder when going
+ * backward) and only the ones whose inputs changed are visited again. Jack only has
+ * structured loops so this settles after a number of sweeps bounded by the loop
+ * nesting depth, each sweep linear in the blocks and accesses. Returns the facts
+ * flowing into each block, before it going forward and after it going backward.
+ * Blocks unreachable from the entry keep the initial facts. */
+std::vector <FlowGraph::BitSet> FlowGraph::Solve(const problem &p, int nVariables) {
+    unsigned long nWords = (nVariables + 63) / 64;
+    BitSet initial = p.intersect ? FullSet(nVariables) : EmptySet(nVariables);
+    std::vector <BitSet> in(blocks.size(), initial), out(blocks.size(), initial);
+
+    std::vector <int> order = ReversePostorder();
+    if (!p.forward)
+        std::reverse(order.begin(), order.end());
+    std::vector <bool> dirty(blocks.size(), true);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b: order) {
+            if (!dirty[b])
+                continue;
+            dirty[b] = false;
+
+            // Meet the facts coming from the neighbours in the direction of flow
+            const std::vector <int> &from = p.forward ? blocks[b].predecessors : blocks[b].successors;
+            bool isBoundary = p.forward ? b == 0 : from.empty();
+            if (isBoundary)
+                in[b] = p.boundary;
+            else {
+                in[b] = from.empty() ? initial : out[from[0]];
+                for (unsigned long i = 1; i < from.size(); i++) {
+                    for (unsigned long w = 0; w < nWords; w++) {
+                        if (p.intersect)
+                            in[b][w] &= out[from[i]][w];
+                        else
+                            in[b][w] |= out[from[i]][w];
+                    }
+                }
+            }
+
+            // Transfer through the block, out = gen | (in & ~kill)
+            BitSet result(nWords);
+            for (unsigned long w = 0; w < nWords; w++)
+                result[w] = p.gen[b][w] | (in[b][w] & ~p.kill[b][w]);
+            if (result != out[b]) {
+                out[b] = result;
+                changed = true;
+                for (int next: p.forward ? blocks[b].successors : blocks[b].predecessors)
+                    dirty[next] = true;
+            }
+        }
+    }
+    return in;
+}
+
+
+/* Definite assignment, a local is assigned at a point only if it is assigned on every
+ * path from the entry to it. Returns every read of a local that may not be. */
+std::vector <Token> FlowGraph::UnassignedReads(int nVariables) {
+    problem p;
+    p.forward = true;
+    p.intersect = true;
+    p.boundary = EmptySet(nVariables);
+    for (const block &b: blocks) {
+        BitSet gen = EmptySet(nVariables);
+        for (const access &a: b.accesses) {
+            if (a.write)
+                SetBit(gen, a.variable);
+        }
+        p.gen.push_back(gen);
+        p.kill.push_back(EmptySet(nVariables));
+    }
+
+    std::vector <BitSet> assignedIn = Solve(p, nVariables);
+    std::vector <Token> reads;
+    for (unsigned long b = 0; b < blocks.size(); b++) {
+        BitSet assigned = assignedIn[b];
+        for (const access &a: blocks[b].accesses) {
+            if (a.write)
+                SetBit(assigned, a.variable);
+            else if (!TestBit(assigned, a.variable))
+                reads.push_back(a.token);
+        }
+    }
+    return reads;
+}
+
+
+// Liveness, a local is live at a point if some path from it reads the local before writing it again
+FlowGraph::problem FlowGraph::Liveness(int nVariables) {
+    problem p;
+    p.forward = false;
+    p.intersect = false;
+    p.boundary = EmptySet(nVariables);
+    for (const block &b: blocks) {
+        BitSet gen = EmptySet(nVariables), kill = EmptySet(nVariables);
+        for (const access &a: b.accesses) {
+            if (a.write)
+                SetBit(kill, a.variable);
+            else if (!TestBit(kill, a.variable))
+                SetBit(gen, a.variable); // Read before any write in the block
+        }
+        p.gen.push_back(gen);
+        p.kill.push_back(kill);
+    }
+    return p;
+}
+
+
+/* Dead stores, returns every write of a local that is not live right after it,
+ * skipping unreachable code. */
+std::vector <Token> FlowGraph::DeadWrites(int nVariables) {
+    std::vector <BitSet> liveOut = Solve(Liveness(nVariables), nVariables);
+    std::vector <int> order = ReversePostorder();
+    std::sort(order.begin(), order.end());
+    std::vector <Token> writes;
+    for (int b: order) {
+        BitSet live = liveOut[b];
+        std::vector <Token> blockWrites;
+        for (unsigned long i = blocks[b].accesses.size(); i > 0; i--) {
+            const access &a = blocks[b].accesses[i-1];
+            if (a.write) {
+                if (!TestBit(live, a.variable))
+                    blockWrites.push_back(a.token);
+                ClearBit(live, a.variable);
+            }
+            else
+                SetBit(live, a.variable);
+        }
+        writes.insert(writes.end(), blockWrites.rbegin(), blockWrites.rend());
+    }
+    return writes;
+}
+
+
+/* Two locals interfere if one is written while the other is live, so they cant share
+ * a slot. Locals that are only read are 0 all along and dont interfere. Returns the
+ * set of locals each one interferes with. */
+std::vector <FlowGraph::BitSet> FlowGraph::Interference(int nVariables) {
+    std::vector <BitSet> liveOut = Solve(Liveness(nVariables), nVariables);
+    std::vector <BitSet> interferes(nVariables, EmptySet(nVariables));
+    for (unsigned long b = 0; b < blocks.size(); b++) {
+        BitSet live = liveOut[b];
+        for (unsigned long i = blocks[b].accesses.size(); i > 0; i--) {
+            const access &a = blocks[b].accesses[i-1];
+            if (!a.write) {
+                SetBit(live, a.variable);
+                continue;
+            }
+            for (int v = 0; v < nVariables; v++) {
+                if (v != a.variable && TestBit(live, v)) {
+                    SetBit(interferes[a.variable], v);
+                    SetBit(interferes[v], a.variable);
+                }
+            }
+            ClearBit(live, a.variable);
+        }
+    }
+    return interferes;
+}
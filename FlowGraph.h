@@ -0,0 +1,61 @@
+#ifndef FLOWGRAPH_H
+#define FLOWGRAPH_H
+
+#include <iostream>
+#include <vector>
+#include "Lexer.h"
+
+/****************** FlowGraph class definitions *****************/
+/* The control flow graph of one subroutine, built while its statements are parsed or
+ * from its VM code by the optimiser. A basic block only keeps the reads and writes of
+ * local variables in the order they happen, which is everything the dataflow analyses
+ * look at. */
+class FlowGraph {
+public:
+    typedef std::vector <unsigned long long> BitSet; // One bit per local variable
+
+    typedef struct {
+        bool write;
+        int variable; // Offset of the local
+        Token token;
+    } access;
+
+    typedef struct {
+        std::vector <access> accesses;
+        std::vector <int> successors;
+        std::vector <int> predecessors;
+    } block;
+
+    /* A dataflow problem, the gen and kill sets of each block, whether facts flow
+     * forward or backward, if they meet by intersection (must) or union (may), and the
+     * facts at the boundary, the entry block or the blocks with no successors */
+    typedef struct {
+        bool forward;
+        bool intersect;
+        std::vector <BitSet> gen;
+        std::vector <BitSet> kill;
+        BitSet boundary;
+    } problem;
+
+    std::vector <block> blocks;
+    int current; // The block statements are being added to
+
+public:
+    void Reset();
+    int NewBlock();
+    void AddEdge(int from, int to);
+    void Read(int variable, Token t);
+    void Write(int variable, Token t);
+    std::vector <BitSet> Solve(const problem &p, int nVariables);
+
+    // Analyses
+    std::vector <Token> UnassignedReads(int nVariables);
+    std::vector <Token> DeadWrites(int nVariables);
+    std::vector <BitSet> Interference(int nVariables);
+
+private:
+    std::vector <int> ReversePostorder();
+    problem Liveness(int nVariables);
+};
+
+#endif
@@ -0,0 +1,1588 @@
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "CompilerHeaders.h"
+
+typedef VmInstruction I;
+
+
+static bool IsPush(const I &i, I::segmentName segment, int index) {
+    return i.op == I::push && i.segment == segment && i.operand == index;
+}
+
+
+static bool IsPop(const I &i, I::segmentName segment, int index) {
+    return i.op == I::pop && i.segment == segment && i.operand == index;
+}
+
+
+static I Make(I::opcode op, I::segmentName segment, int operand) {
+    I i = {op, segment, 0, operand};
+    return i;
+}
+
+
+static bool Same(const I &a, const I &b) {
+    return a.op == b.op && a.segment == b.segment && a.operand == b.operand;
+}
+
+
+// Forget an expression that reads segment index, any index if it is -1
+static void ForgetReads(std::vector<I> &expression, I::segmentName segment, int index) {
+    for (const I &i: expression) {
+        if (i.op == I::push && i.segment == segment && (index < 0 || i.operand == index)) {
+            expression.clear();
+            return;
+        }
+    }
+}
+
+
+static bool IsCall(const I &i, I::builtinName function) {
+    return i.op == I::call && i.operand == function;
+}
+
+
+// A push that only reads a value, it can be moved or dropped
+static bool IsSimplePush(const I &i) {
+    return i.op == I::push && i.segment != I::that && i.segment != I::pointer;
+}
+
+
+// Wrap a value to 16 bit two's complement like the Hack platform
+static int Wrap(long value) {
+    value &= 0xFFFF;
+    return value >= 0x8000 ? value - 0x10000 : value;
+}
+
+
+/* The start of the expression pushing the value on top of the stack at end, if it is
+ * only simple pushes and additions so it can be evaluated again with the same result.
+ * Returns end if it is not. */
+static unsigned long PureAddressBefore(const std::vector<I> &code, unsigned long end) {
+    long needed = 1; // Values still to be accounted for, walking backwards
+    unsigned long start = end;
+    while (needed > 0 && start > 0 && end - start < 8) {
+        const I &i = code[--start];
+        if (IsSimplePush(i) && i.segment != I::temp)
+            needed--;
+        else if (i.op == I::add || i.op == I::sub)
+            needed++;
+        else
+            return end;
+    }
+    return needed == 0 ? start : end;
+}
+
+
+/* The start of the pure expression ending just before end, simple pushes, operators,
+ * array reads 'pop pointer 1; push that k' and calls to Math.multiply or Math.divide.
+ * It can be evaluated again with the same result as long as nothing it reads is
+ * written. Returns end if there isnt one. */
+static unsigned long ExpressionStart(const std::vector<I> &code, unsigned long end) {
+    long needed = 1; // Values still to be accounted for, walking backwards
+    unsigned long start = end;
+    while (needed > 0 && start > 0) {
+        const I &i = code[--start];
+        if (i.op == I::push && i.segment == I::that && start > 0 && IsPop(code[start-1], I::pointer, 1))
+            start--; // Takes the address and gives the entry
+        else if (IsSimplePush(i) && i.segment != I::temp)
+            needed--;
+        else if (i.op == I::add || i.op == I::sub || i.op == I::eq || i.op == I::gt ||
+                 i.op == I::lt || i.op == I::AND || i.op == I::OR ||
+                 IsCall(i, I::multiply) || IsCall(i, I::divide))
+            needed++;
+        else if (i.op != I::neg && i.op != I::NOT)
+            return end;
+    }
+    return needed == 0 ? start : end;
+}
+
+
+// Would the instruction change the value of the expression
+static bool Invalidates(const I &i, const I *expression, unsigned long length) {
+    bool call = i.op == I::call && !IsCall(i, I::multiply) && !IsCall(i, I::divide);
+    if (i.op != I::pop && !call)
+        return false;
+    bool memory = call || i.segment == I::THIS || i.segment == I::that; // Any field or entry
+    for (unsigned long e = 0; e < length; e++) {
+        const I &read = expression[e];
+        if (read.op != I::push)
+            continue;
+        if (memory && (read.segment == I::THIS || read.segment == I::that))
+            return true;
+        if (call && read.segment == I::STATIC)
+            return true;
+        if (i.op == I::pop && read.segment == i.segment && read.operand == i.operand)
+            return true;
+        if (IsPop(i, I::pointer, 0) && read.segment == I::THIS)
+            return true;
+    }
+    return false;
+}
+
+
+/* A loop in the VM code of a function, from a label to the last jump back to it,
+ * with what the instructions in it write */
+typedef struct {
+    unsigned long last; // The last jump back to the label
+    std::unordered_set <long> written; // segment << 16 | index
+    bool memory; // A field or an array entry
+    bool calls;
+    bool pointer0;
+} loop;
+
+
+/* Is the label at head the start of a loop, jumped back to from further on and with
+ * no jump into the loop from outside other than to the label */
+static bool FindLoop(const std::vector<I> &function, unsigned long head, loop &l) {
+    if (function[head].op != I::label)
+        return false;
+    l.last = head;
+    for (unsigned long j = 0; j < function.size(); j++) {
+        if ((function[j].op == I::GOTO || function[j].op == I::ifGoto) &&
+            function[j].operand == function[head].operand) {
+            if (j < head)
+                return false;
+            l.last = j;
+        }
+    }
+    if (l.last == head)
+        return false;
+
+    std::unordered_set <int> inside;
+    for (unsigned long j = head + 1; j <= l.last; j++) {
+        if (function[j].op == I::label)
+            inside.insert(function[j].operand);
+    }
+    l.written.clear();
+    l.memory = l.calls = l.pointer0 = false;
+    for (unsigned long j = 0; j < function.size(); j++) {
+        const I &ins = function[j];
+        if (j <= head || j > l.last) {
+            if ((ins.op == I::GOTO || ins.op == I::ifGoto) && inside.count(ins.operand))
+                return false;
+            continue;
+        }
+        if (ins.op == I::call && !IsCall(ins, I::multiply) && !IsCall(ins, I::divide))
+            l.calls = l.memory = true;
+        else if (ins.op == I::pop) {
+            l.written.insert((long)ins.segment << 16 | ins.operand);
+            if (ins.segment == I::THIS || ins.segment == I::that)
+                l.memory = true;
+            if (IsPop(ins, I::pointer, 0))
+                l.pointer0 = true;
+        }
+    }
+    return true;
+}
+
+
+// Does a push read the same value on every pass through the loop
+static bool Invariant(const I &read, const loop &l) {
+    if (l.written.count((long)read.segment << 16 | read.operand))
+        return false;
+    if (read.segment == I::THIS)
+        return !l.memory && !l.pointer0;
+    if (read.segment == I::that)
+        return !l.memory;
+    if (read.segment == I::STATIC)
+        return !l.calls;
+    return read.segment != I::temp && read.segment != I::pointer;
+}
+
+
+/* If the instructions before end push a constant, its value and how many instructions
+ * push it, 'push constant k' or 'push constant k' followed by a neg or a not. Returns
+ * 0 if they dont. */
+static unsigned long ConstantBefore(const std::vector<I> &code, unsigned long end, int &value) {
+    if (end >= 1 && code[end-1].op == I::push && code[end-1].segment == I::constant) {
+        value = code[end-1].operand;
+        return 1;
+    }
+    if (end >= 2 && code[end-2].op == I::push && code[end-2].segment == I::constant) {
+        if (code[end-1].op == I::neg) {
+            value = Wrap(-(long)code[end-2].operand);
+            return 2;
+        }
+        if (code[end-1].op == I::NOT) {
+            value = Wrap(~(long)code[end-2].operand);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+
+/* The instructions pushing a constant, push constant only takes 0 to 32767 so a
+ * negative value is negated, -32768 is the bitwise not of 32767 */
+static unsigned long PushConstant(int value, I *out) {
+    if (value >= 0) {
+        out[0] = Make(I::push, I::constant, value);
+        return 1;
+    }
+    if (value == -32768) {
+        out[0] = Make(I::push, I::constant, 32767);
+        out[1] = Make(I::NOT, I::constant, 0);
+        return 2;
+    }
+    out[0] = Make(I::push, I::constant, -value);
+    out[1] = Make(I::neg, I::constant, 0);
+    return 2;
+}
+
+
+// The value of an operator on constants, false if it cant be worked out
+static bool Evaluate(const I &op, int a, int b, int &result) {
+    switch (op.op) {
+        case I::add: result = Wrap((long)a + b); return true;
+        case I::sub: result = Wrap((long)a - b); return true;
+        case I::AND: result = a & b; return true;
+        case I::OR: result = a | b; return true;
+        case I::eq: result = a == b ? -1 : 0; return true;
+        case I::gt: result = a > b ? -1 : 0; return true;
+        case I::lt: result = a < b ? -1 : 0; return true;
+        case I::call:
+            if (IsCall(op, I::multiply)) {
+                result = Wrap((long)a * b);
+                return true;
+            }
+            // Math.divide rounds towards zero, leave dividing by zero to fail at run time
+            if (IsCall(op, I::divide) && b != 0 && a != -32768 && b != -32768) {
+                result = a / b;
+                return true;
+            }
+            return false;
+        default:
+            return false;
+    }
+}
+
+
+/************************* Peephole patterns *************************/
+// push X n, pop X n stores back the value it just read
+static bool PushPopMatch(const I *c) {
+    return c[0].op == I::push && c[0].segment != I::constant &&
+           IsPop(c[1], c[0].segment, c[0].operand);
+}
+static unsigned long RemoveAll(const I *, I *) {
+    return 0;
+}
+
+// push constant 0, neg is still 0
+static bool NegZeroMatch(const I *c) {
+    return IsPush(c[0], I::constant, 0) && c[1].op == I::neg;
+}
+static unsigned long KeepFirst(const I *c, I *out) {
+    out[0] = c[0];
+    return 1;
+}
+
+// not, not cancel out as not is bitwise
+static bool NotNotMatch(const I *c) {
+    return c[0].op == I::NOT && c[1].op == I::NOT;
+}
+
+// goto L straight before label L
+static bool GotoNextMatch(const I *c) {
+    return c[0].op == I::GOTO && c[1].op == I::label && c[0].operand == c[1].operand;
+}
+static unsigned long KeepLast(const I *c, I *out) {
+    out[0] = c[1];
+    return 1;
+}
+
+/* An if without an else ends with 'goto L2, label L1, label L2', the goto only
+ * jumps over a label */
+static bool GotoOverLabelMatch(const I *c) {
+    return c[0].op == I::GOTO && c[1].op == I::label && c[2].op == I::label &&
+           c[0].operand == c[2].operand;
+}
+static unsigned long KeepLabels(const I *c, I *out) {
+    out[0] = c[1];
+    out[1] = c[2];
+    return 2;
+}
+
+// push constant 0, add adds nothing
+static bool AddZeroMatch(const I *c) {
+    return IsPush(c[0], I::constant, 0) && c[1].op == I::add;
+}
+
+/* Reading a[k] with a constant index, 'push constant k, add, pop pointer 1,
+ * push that 0' becomes 'pop pointer 1, push that k' */
+static bool ConstantIndexReadMatch(const I *c) {
+    return c[0].op == I::push && c[0].segment == I::constant && c[1].op == I::add &&
+           IsPop(c[2], I::pointer, 1) && IsPush(c[3], I::that, 0);
+}
+static unsigned long ConstantIndexRead(const I *c, I *out) {
+    out[0] = c[2];
+    out[1] = Make(I::push, I::that, c[0].operand);
+    return 2;
+}
+
+/* Writing a[i] = y with y a single push that doesnt depend on 'that', 'push y,
+ * pop temp 0, pop pointer 1, push temp 0, pop that 0' doesnt need temp 0 if the
+ * pointer is set first, 'pop pointer 1, push y, pop that 0' */
+static bool SinglePushStoreMatch(const I *c) {
+    return c[0].op == I::push && c[0].segment != I::that && c[0].segment != I::pointer &&
+           IsPop(c[1], I::temp, 0) && IsPop(c[2], I::pointer, 1) &&
+           IsPush(c[3], I::temp, 0) && IsPop(c[4], I::that, 0);
+}
+static unsigned long SinglePushStore(const I *c, I *out) {
+    out[0] = c[2];
+    out[1] = c[0];
+    out[2] = c[4];
+    return 3;
+}
+
+/* The same store with a constant index, 'push constant k, add, pop pointer 1,
+ * push y, pop that 0' becomes 'pop pointer 1, push y, pop that k' */
+static bool ConstantIndexWriteMatch(const I *c) {
+    return c[0].op == I::push && c[0].segment == I::constant && c[1].op == I::add &&
+           IsPop(c[2], I::pointer, 1) && c[3].op == I::push && c[3].segment != I::that &&
+           c[3].segment != I::pointer && IsPop(c[4], I::that, 0);
+}
+static unsigned long ConstantIndexWrite(const I *c, I *out) {
+    out[0] = c[2];
+    out[1] = c[3];
+    out[2] = Make(I::pop, I::that, c[0].operand);
+    return 3;
+}
+
+// push constant 0, sub takes nothing away
+static bool SubZeroMatch(const I *c) {
+    return IsPush(c[0], I::constant, 0) && c[1].op == I::sub;
+}
+
+// neg, neg cancel out
+static bool NegNegMatch(const I *c) {
+    return c[0].op == I::neg && c[1].op == I::neg;
+}
+
+// x * 1 and x / 1
+static bool MultiplyOneMatch(const I *c) {
+    return IsPush(c[0], I::constant, 1) && IsCall(c[1], I::multiply);
+}
+static bool DivideOneMatch(const I *c) {
+    return IsPush(c[0], I::constant, 1) && IsCall(c[1], I::divide);
+}
+
+// x * 0 is 0 but x may have side effects, 'x & 0' still evaluates it without a call
+static bool MultiplyZeroMatch(const I *c) {
+    return IsPush(c[0], I::constant, 0) && IsCall(c[1], I::multiply);
+}
+static unsigned long AndZero(const I *c, I *out) {
+    out[0] = c[0];
+    out[1] = Make(I::AND, I::constant, 0);
+    return 2;
+}
+
+// 1 * y and 0 + y where y is a single push
+static bool OneTimesMatch(const I *c) {
+    return IsPush(c[0], I::constant, 1) && IsSimplePush(c[1]) && IsCall(c[2], I::multiply);
+}
+static bool ZeroPlusMatch(const I *c) {
+    return IsPush(c[0], I::constant, 0) && IsSimplePush(c[1]) && c[2].op == I::add;
+}
+static unsigned long KeepSecond(const I *c, I *out) {
+    out[0] = c[1];
+    return 1;
+}
+
+// 0 * y where y is a single push, nothing needs to be evaluated
+static bool ZeroTimesMatch(const I *c) {
+    return IsPush(c[0], I::constant, 0) && IsSimplePush(c[1]) && IsCall(c[2], I::multiply);
+}
+
+/* A negated comparison with a constant is the opposite comparison with the next
+ * constant, 'x < k, not' is 'x > k-1' and 'x > k, not' is 'x < k+1' */
+static bool NotLessMatch(const I *c) {
+    return c[0].op == I::push && c[0].segment == I::constant && c[0].operand >= 1 &&
+           c[1].op == I::lt && c[2].op == I::NOT;
+}
+static unsigned long NotLess(const I *c, I *out) {
+    out[0] = Make(I::push, I::constant, c[0].operand - 1);
+    out[1] = Make(I::gt, I::constant, 0);
+    return 2;
+}
+static bool NotGreaterMatch(const I *c) {
+    return c[0].op == I::push && c[0].segment == I::constant && c[0].operand < 32767 &&
+           c[1].op == I::gt && c[2].op == I::NOT;
+}
+static unsigned long NotGreater(const I *c, I *out) {
+    out[0] = Make(I::push, I::constant, c[0].operand + 1);
+    out[1] = Make(I::lt, I::constant, 0);
+    return 2;
+}
+
+// if-goto jumps on anything but 0, so 'x = 0, not, if-goto L' only needs x
+static bool IfNonZeroMatch(const I *c) {
+    return IsPush(c[0], I::constant, 0) && c[1].op == I::eq && c[2].op == I::NOT &&
+           c[3].op == I::ifGoto;
+}
+static unsigned long KeepFourth(const I *c, I *out) {
+    out[0] = c[3];
+    return 1;
+}
+
+static const Optimiser::pattern patterns[] = {
+    {"push-pop", 2, PushPopMatch, RemoveAll},
+    {"neg-zero", 2, NegZeroMatch, KeepFirst},
+    {"not-not", 2, NotNotMatch, RemoveAll},
+    {"goto-next", 2, GotoNextMatch, KeepLast},
+    {"goto-over-label", 3, GotoOverLabelMatch, KeepLabels},
+    {"add-zero", 2, AddZeroMatch, RemoveAll},
+    {"constant-index-read", 4, ConstantIndexReadMatch, ConstantIndexRead},
+    {"single-push-store", 5, SinglePushStoreMatch, SinglePushStore},
+    {"constant-index-write", 5, ConstantIndexWriteMatch, ConstantIndexWrite},
+    {"sub-zero", 2, SubZeroMatch, RemoveAll},
+    {"neg-neg", 2, NegNegMatch, RemoveAll},
+    {"multiply-one", 2, MultiplyOneMatch, RemoveAll},
+    {"divide-one", 2, DivideOneMatch, RemoveAll},
+    {"multiply-zero", 2, MultiplyZeroMatch, AndZero},
+    {"one-times", 3, OneTimesMatch, KeepSecond},
+    {"zero-plus", 3, ZeroPlusMatch, KeepSecond},
+    {"zero-times", 3, ZeroTimesMatch, KeepFirst},
+    {"not-less", 3, NotLessMatch, NotLess},
+    {"not-greater", 3, NotGreaterMatch, NotGreater},
+    {"if-nonzero", 4, IfNonZeroMatch, KeepFourth},
+};
+static const unsigned long nPatterns = sizeof(patterns) / sizeof(patterns[0]);
+static const unsigned long maxPatternLength = 5;
+
+
+Optimiser::Optimiser() {
+    peepholeHits.assign(nPatterns, 0);
+    foldedConstants = 0;
+    reducedMultiplications = 0;
+    removedFunctions = 0;
+    inlinedCalls = 0;
+    loopedTailCalls = 0;
+    removedFields = 0;
+    elidedPointerLoads = 0;
+    eliminatedSubexpressions = 0;
+    hoistedInvariants = 0;
+    reducedInductionVariables = 0;
+    rotatedLoops = 0;
+    invertedBranches = 0;
+    threadedJumps = 0;
+    removedUnreachable = 0;
+    removedLabels = 0;
+    coalescedLocals = 0;
+}
+
+
+/* Run the peephole patterns over the VM code of a file until none of them matches
+ * anymore. No pattern matches a function instruction, so each function is
+ * rewritten on its own. */
+void Optimiser::Peephole(Code &code) {
+    while (PeepholeSweep(code))
+        ;
+}
+
+
+/* One pass, every instruction is copied down to the end of the output and the
+ * patterns are tried on the tail of the output, so a rewrite that exposes another
+ * match before it is found straight away. Returns true if anything changed. */
+bool Optimiser::PeepholeSweep(Code &code) {
+    unsigned long out = 0;
+    bool changed = false;
+    for (unsigned long in = 0; in < code.size(); in++) {
+        code[out++] = code[in];
+        bool matched = true;
+        while (matched) {
+            matched = false;
+            for (unsigned long p = 0; p < nPatterns && !matched; p++) {
+                unsigned long length = patterns[p].length;
+                if (out < length || !patterns[p].match(&code[out - length]))
+                    continue;
+                VmInstruction replacement[maxPatternLength];
+                unsigned long n = patterns[p].rewrite(&code[out - length], replacement);
+                out -= length;
+                for (unsigned long r = 0; r < n; r++)
+                    code[out++] = replacement[r];
+                peepholeHits[p]++;
+                matched = changed = true;
+            }
+            if (!matched && FoldConstant(code, out))
+                matched = changed = true;
+        }
+    }
+    code.resize(out);
+    return changed;
+}
+
+
+/* Fold an operator on constants at the end of the output into the constant it
+ * evaluates to, as long as that takes fewer instructions */
+bool Optimiser::FoldConstant(Code &code, unsigned long &out) {
+    if (out < 2)
+        return false;
+    const I op = code[out-1];
+    int a, b, result;
+    unsigned long lengthA, lengthB;
+    if (op.op == I::neg || op.op == I::NOT) {
+        if (!(lengthA = ConstantBefore(code, out - 1, a)))
+            return false;
+        result = op.op == I::neg ? Wrap(-(long)a) : Wrap(~(long)a);
+    }
+    else {
+        if (!(lengthB = ConstantBefore(code, out - 1, b)) ||
+            !(lengthA = ConstantBefore(code, out - 1 - lengthB, a)) ||
+            !Evaluate(op, a, b, result))
+            return false;
+        lengthA += lengthB;
+    }
+
+    VmInstruction replacement[2];
+    unsigned long n = PushConstant(result, replacement);
+    if (n >= lengthA + 1)
+        return false;
+    out -= lengthA + 1;
+    for (unsigned long r = 0; r < n; r++)
+        code[out++] = replacement[r];
+    foldedConstants++;
+    return true;
+}
+
+
+/* Multiplications by a constant become doublings and adds of x. The signed digits
+ * of the constant are used so a run of ones costs one subtraction, x*15 is x*16-x.
+ * The call is kept if the inline sequence would be longer than MULTIPLY_CALL_COST.
+ * The VM code grows, so this is its own pass rather than a peephole pattern. */
+void Optimiser::ReduceMultiplications(Code &code) {
+    Code reduced;
+    reduced.reserve(code.size());
+    for (const I &i: code) {
+        reduced.push_back(i);
+        if (IsCall(i, I::multiply) && ReduceMultiplication(reduced))
+            reducedMultiplications++;
+    }
+    code.swap(reduced);
+}
+
+
+/* Rewrite the multiplication at the end of the code, 'x, k, call Math.multiply 2' or
+ * 'k, y, call Math.multiply 2' for a single push y. x is kept in temp 1 unless it is
+ * a single push that can be repeated, temp 2 holds the product while doubling. */
+bool Optimiser::ReduceMultiplication(Code &code) {
+    unsigned long end = code.size() - 1; // The call
+    unsigned long start, lengthK;
+    int k;
+    I x = Make(I::push, I::temp, 1);
+    bool keepX = true; // x is on the stack and has to be saved to temp 1
+    if ((lengthK = ConstantBefore(code, end, k))) {
+        start = end - lengthK;
+        if (start >= 1 && IsSimplePush(code[start-1]) && code[start-1].segment != I::temp) {
+            x = code[--start];
+            keepX = false;
+        }
+    }
+    else if (end >= 2 && IsSimplePush(code[end-1]) && code[end-1].segment != I::temp &&
+             (lengthK = ConstantBefore(code, end - 1, k))) {
+        x = code[end-1];
+        keepX = false;
+        start = end - 1 - lengthK;
+    }
+    else
+        return false;
+    if (k == 0 || k == -32768)
+        return false;
+
+    // Signed binary digits of |k|, least significant first, the top digit is 1
+    std::vector <int> digits;
+    for (int n = k < 0 ? -k : k; n > 0; n /= 2) {
+        int digit = n % 2 ? 2 - n % 4 : 0;
+        digits.push_back(digit);
+        n -= digit;
+    }
+
+    Code sequence;
+    if (keepX)
+        sequence.push_back(Make(I::pop, I::temp, 1));
+    sequence.push_back(x);
+    for (unsigned long d = digits.size() - 1; d > 0; d--) {
+        if (d == digits.size() - 1) { // The product is still x, double it as x + x
+            sequence.push_back(x);
+            sequence.push_back(Make(I::add, I::constant, 0));
+        }
+        else {
+            sequence.push_back(Make(I::pop, I::temp, 2));
+            sequence.push_back(Make(I::push, I::temp, 2));
+            sequence.push_back(Make(I::push, I::temp, 2));
+            sequence.push_back(Make(I::add, I::constant, 0));
+        }
+        if (digits[d-1] != 0) {
+            sequence.push_back(x);
+            sequence.push_back(Make(digits[d-1] > 0 ? I::add : I::sub, I::constant, 0));
+        }
+    }
+    if (k < 0)
+        sequence.push_back(Make(I::neg, I::constant, 0));
+
+    if (sequence.size() > MULTIPLY_CALL_COST)
+        return false;
+    code.resize(start);
+    code.insert(code.end(), sequence.begin(), sequence.end());
+    return true;
+}
+
+
+/* Local common subexpression elimination, within each block a pure expression that
+ * is evaluated again before anything it reads is written is kept in a hidden local.
+ * The first evaluation is followed by 'pop local h; push local h' and the others
+ * become 'push local h'. The hidden locals are reused from one block to the next. */
+void Optimiser::EliminateCommonSubexpressions(Code &code) {
+    Code out;
+    out.reserve(code.size());
+    unsigned long function = 0; // Of the current function in out
+    int firstHidden = 0;
+    unsigned long i = 0;
+    while (i < code.size()) {
+        // A block ends at any jump and a label starts the next one
+        unsigned long end = i;
+        while (end < code.size() && code[end].op != I::label && code[end].op != I::GOTO &&
+               code[end].op != I::ifGoto && code[end].op != I::RETURN &&
+               code[end].op != I::function)
+            end++;
+        if (end == i) {
+            if (code[i].op == I::function) {
+                function = out.size();
+                firstHidden = code[i].count;
+            }
+            out.push_back(code[i++]);
+            continue;
+        }
+
+        Code block(code.begin() + i, code.begin() + end);
+        int nextHidden = firstHidden;
+        while (EliminateCommonSubexpression(block, nextHidden))
+            eliminatedSubexpressions++;
+        if (nextHidden > out[function].count)
+            out[function].count = nextHidden;
+        out.insert(out.end(), block.begin(), block.end());
+        i = end;
+    }
+    code.swap(out);
+}
+
+
+/* Find the repeated expression of the block that saves the most instructions and keep
+ * it in local nextHidden, a call to Math.multiply or Math.divide counts as many */
+bool Optimiser::EliminateCommonSubexpression(Code &block, int &nextHidden) {
+    std::vector <unsigned long> starts(block.size() + 1);
+    for (unsigned long e = 1; e <= block.size(); e++)
+        starts[e] = ExpressionStart(block, e);
+
+    long bestSaving = 0;
+    std::vector <unsigned long> best; // The end of each occurrence
+    for (unsigned long e = 1; e <= block.size(); e++) {
+        unsigned long start = starts[e], length = e - start;
+        if (length < 2)
+            continue;
+        const I *expression = &block[start];
+        long cost = length;
+        for (unsigned long k = 0; k < length; k++) {
+            if (IsCall(expression[k], I::multiply) || IsCall(expression[k], I::divide))
+                cost += MULTIPLY_CALL_COST;
+        }
+
+        std::vector <unsigned long> found = {e};
+        for (unsigned long p = e; p < block.size(); p++) {
+            if (Invalidates(block[p], expression, length))
+                break;
+            unsigned long s = starts[p+1];
+            if (p + 1 - s == length && s >= found.back() &&
+                std::equal(expression, expression + length, block.begin() + s, Same))
+                found.push_back(p + 1);
+        }
+        long saving = (long)(found.size() - 1) * (cost - 1) - 2;
+        if (saving > bestSaving) {
+            bestSaving = saving;
+            best = found;
+        }
+    }
+    if (best.empty())
+        return false;
+
+    int hidden = nextHidden++;
+    Code rewritten;
+    rewritten.reserve(block.size());
+    unsigned long copied = 0;
+    for (unsigned long n = 0; n < best.size(); n++) {
+        unsigned long start = starts[best[n]];
+        if (n == 0) {
+            rewritten.insert(rewritten.end(), block.begin() + copied, block.begin() + best[n]);
+            rewritten.push_back(Make(I::pop, I::local, hidden));
+        }
+        else
+            rewritten.insert(rewritten.end(), block.begin() + copied, block.begin() + start);
+        rewritten.push_back(Make(I::push, I::local, hidden));
+        copied = best[n];
+    }
+    rewritten.insert(rewritten.end(), block.begin() + copied, block.end());
+    block.swap(rewritten);
+    return true;
+}
+
+
+/* Loop invariant code motion. A loop is a label with a jump back to it from further
+ * on and no jump into it from outside other than to the label. A pure expression in
+ * the loop that reads nothing the loop writes is evaluated once into a hidden local,
+ * just before the label. Divisions are left, they could be by 0 when the loop or the
+ * branch they are in would not have run. */
+void Optimiser::HoistLoopInvariants(Code &code) {
+    Code out;
+    out.reserve(code.size());
+    unsigned long i = 0;
+    while (i < code.size()) {
+        unsigned long end = i + 1;
+        while (end < code.size() && code[end].op != I::function)
+            end++;
+        Code function(code.begin() + i, code.begin() + end);
+        while (HoistLoopInvariant(function))
+            hoistedInvariants++;
+        out.insert(out.end(), function.begin(), function.end());
+        i = end;
+    }
+    code.swap(out);
+}
+
+
+// Hoist the most expensive invariant expression of the first loop that has one
+bool Optimiser::HoistLoopInvariant(Code &function) {
+    loop l;
+    for (unsigned long head = 0; head < function.size(); head++) {
+        if (!FindLoop(function, head, l))
+            continue;
+
+        // The most expensive invariant expression in the loop
+        std::vector <unsigned long> starts(l.last + 2);
+        long bestCost = 0;
+        unsigned long bestEnd = 0;
+        for (unsigned long e = head + 2; e <= l.last + 1; e++) {
+            starts[e] = ExpressionStart(function, e);
+            unsigned long length = e - starts[e];
+            if (length < 2 || starts[e] <= head)
+                continue;
+            long cost = length;
+            bool invariant = true, constant = true; // Constants are folded already
+            for (unsigned long k = starts[e]; k < e && invariant; k++) {
+                const I &read = function[k];
+                if (IsCall(read, I::divide))
+                    invariant = false;
+                else if (IsCall(read, I::multiply))
+                    cost += MULTIPLY_CALL_COST;
+                if (read.op != I::push || read.segment == I::constant)
+                    continue;
+                constant = false;
+                invariant = Invariant(read, l);
+            }
+            if (invariant && !constant && cost > bestCost) {
+                bestCost = cost;
+                bestEnd = e;
+            }
+        }
+        if (bestCost == 0)
+            continue;
+
+        // Every occurrence in the loop reads the hidden local, set before the head
+        int hidden = function[0].count++;
+        const I *expression = &function[starts[bestEnd]];
+        unsigned long length = bestEnd - starts[bestEnd];
+        Code hoisted(function.begin(), function.begin() + head);
+        hoisted.insert(hoisted.end(), expression, expression + length);
+        hoisted.push_back(Make(I::pop, I::local, hidden));
+        unsigned long copied = head;
+        for (unsigned long e = head + 2; e <= l.last + 1; e++) {
+            if (e - starts[e] == length && starts[e] >= copied &&
+                std::equal(expression, expression + length, function.begin() + starts[e], Same)) {
+                hoisted.insert(hoisted.end(), function.begin() + copied, function.begin() + starts[e]);
+                hoisted.push_back(Make(I::push, I::local, hidden));
+                copied = e;
+            }
+        }
+        hoisted.insert(hoisted.end(), function.begin() + copied, function.end());
+        function.swap(hoisted);
+        return true;
+    }
+    return false;
+}
+
+
+/* Induction variable strength reduction. In a loop where a local or argument i only
+ * changes by 'let i = i + c' or 'let i = i - c', a product i * k by an invariant k
+ * is kept in a hidden local. It is worked out once before the loop and after each
+ * change of i is changed by c * k. If k is not a constant c has to be 1. */
+void Optimiser::ReduceInductionVariables(Code &code) {
+    Code out;
+    out.reserve(code.size());
+    unsigned long i = 0;
+    while (i < code.size()) {
+        unsigned long end = i + 1;
+        while (end < code.size() && code[end].op != I::function)
+            end++;
+        Code function(code.begin() + i, code.begin() + end);
+        while (ReduceInductionVariable(function))
+            reducedInductionVariables++;
+        out.insert(out.end(), function.begin(), function.end());
+        i = end;
+    }
+    code.swap(out);
+}
+
+
+// Reduce the first product of an induction variable and an invariant found
+bool Optimiser::ReduceInductionVariable(Code &function) {
+    loop l;
+    for (unsigned long head = 0; head < function.size(); head++) {
+        if (!FindLoop(function, head, l))
+            continue;
+
+        for (unsigned long m = head + 3; m <= l.last; m++) {
+            if (!IsCall(function[m], I::multiply) || ExpressionStart(function, m + 1) != m - 2)
+                continue;
+            for (int side = 0; side < 2; side++) {
+                const I &variable = function[m - 2 + side], &k = function[m - 1 - side];
+                if ((variable.segment != I::local && variable.segment != I::argument) ||
+                    !Invariant(k, l) || Same(variable, k))
+                    continue;
+
+                // Every write to the variable in the loop has to be a step by a constant
+                std::unordered_map <unsigned long, int> steps; // By the position of the pop
+                bool induction = true;
+                for (unsigned long p = head + 1; p <= l.last && induction; p++) {
+                    if (!IsPop(function[p], variable.segment, variable.operand))
+                        continue;
+                    int c;
+                    induction = false;
+                    if (p >= head + 4 && (function[p-1].op == I::add || function[p-1].op == I::sub)) {
+                        bool plus = function[p-1].op == I::add;
+                        if (Same(function[p-3], variable) && ConstantBefore(function, p - 1, c) == 1)
+                            induction = true;
+                        else if (plus && Same(function[p-2], variable) &&
+                                 function[p-3].op == I::push && function[p-3].segment == I::constant) {
+                            c = function[p-3].operand;
+                            induction = true;
+                        }
+                        if (induction)
+                            steps[p] = plus ? c : -c;
+                    }
+                    if (induction && k.segment != I::constant && steps[p] != 1 && steps[p] != -1)
+                        induction = false;
+                }
+                if (!induction || steps.empty())
+                    continue;
+
+                // The product is set before the loop and stepped after each change
+                int hidden = function[0].count++;
+                I product[3] = {function[m-2], function[m-1], function[m]};
+                Code reduced(function.begin(), function.begin() + head);
+                reduced.insert(reduced.end(), product, product + 3);
+                reduced.push_back(Make(I::pop, I::local, hidden));
+                for (unsigned long j = head; j < function.size(); j++) {
+                    if (j > head && j + 2 <= l.last && IsCall(function[j+2], I::multiply) &&
+                        ((Same(function[j], product[0]) && Same(function[j+1], product[1])) ||
+                         (Same(function[j], product[1]) && Same(function[j+1], product[0])))) {
+                        reduced.push_back(Make(I::push, I::local, hidden));
+                        j += 2;
+                        continue;
+                    }
+                    reduced.push_back(function[j]);
+                    if (!steps.count(j))
+                        continue;
+                    reduced.push_back(Make(I::push, I::local, hidden));
+                    if (k.segment == I::constant) {
+                        I step[2];
+                        unsigned long length = PushConstant(Wrap((long)steps[j] * k.operand), step);
+                        reduced.insert(reduced.end(), step, step + length);
+                        reduced.push_back(Make(I::add, I::constant, 0));
+                    }
+                    else {
+                        reduced.push_back(k);
+                        reduced.push_back(Make(steps[j] > 0 ? I::add : I::sub, I::constant, 0));
+                    }
+                    reduced.push_back(Make(I::pop, I::local, hidden));
+                }
+                function.swap(reduced);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+/* Branches are rearranged once the code of a function is final. A while loop is
+ * rotated so its condition is at the bottom with a single jump back per pass, an
+ * if with an else has its branches swapped rather than negating the condition,
+ * jumps to a goto go straight to its target, and code that cant be reached and the
+ * labels nothing jumps to are dropped. */
+void Optimiser::ThreadJumps(Code &code) {
+    int nextLabel = 0;
+    for (const I &i: code) {
+        if (i.op == I::label && i.operand >= nextLabel)
+            nextLabel = i.operand + 1;
+    }
+
+    Code out;
+    out.reserve(code.size());
+    unsigned long i = 0;
+    while (i < code.size()) {
+        unsigned long end = i + 1;
+        while (end < code.size() && code[end].op != I::function)
+            end++;
+        Code function(code.begin() + i, code.begin() + end);
+        while (RotateLoop(function, nextLabel))
+            rotatedLoops++;
+        while (InvertBranch(function))
+            invertedBranches++;
+        while (ThreadFunctionJumps(function))
+            ;
+        out.insert(out.end(), function.begin(), function.end());
+        i = end;
+    }
+    code.swap(out);
+}
+
+
+// Is the value of the instruction always true or false, -1 or 0
+static bool IsComparison(const I &i) {
+    return i.op == I::eq || i.op == I::gt || i.op == I::lt;
+}
+
+
+// The number of jumps to a label, and the position of the last one
+static unsigned long JumpsTo(const std::vector<I> &function, int label, unsigned long &last) {
+    unsigned long jumps = 0;
+    for (unsigned long j = 0; j < function.size(); j++) {
+        if ((function[j].op == I::GOTO || function[j].op == I::ifGoto) && function[j].operand == label) {
+            jumps++;
+            last = j;
+        }
+    }
+    return jumps;
+}
+
+
+/* 'label A, condition, not, if-goto B, body, goto A, label B' becomes 'goto T,
+ * label A, body, label T, condition, if-goto A, label B'. The condition has to end
+ * with a comparison so dropping or adding the not is the same as inverting it. */
+bool Optimiser::RotateLoop(Code &function, int &nextLabel) {
+    for (unsigned long head = 0; head < function.size(); head++) {
+        if (function[head].op != I::label)
+            continue;
+        unsigned long test = head + 1;
+        while (test < function.size() && function[test].op != I::label &&
+               function[test].op != I::GOTO && function[test].op != I::ifGoto &&
+               function[test].op != I::RETURN)
+            test++;
+        if (test >= function.size() || function[test].op != I::ifGoto)
+            continue;
+        bool negated = function[test-1].op == I::NOT;
+        unsigned long comparison = negated ? test - 2 : test - 1;
+        if (comparison <= head || !IsComparison(function[comparison]))
+            continue;
+        unsigned long back;
+        if (JumpsTo(function, function[head].operand, back) != 1 || function[back].op != I::GOTO ||
+            back <= test || back + 1 >= function.size() ||
+            function[back+1].op != I::label || function[back+1].operand != function[test].operand)
+            continue;
+
+        int top = nextLabel++;
+        Code rotated(function.begin(), function.begin() + head);
+        rotated.push_back(Make(I::GOTO, I::constant, top));
+        rotated.push_back(function[head]);
+        rotated.insert(rotated.end(), function.begin() + test + 1, function.begin() + back);
+        rotated.push_back(Make(I::label, I::constant, top));
+        rotated.insert(rotated.end(), function.begin() + head + 1, function.begin() + comparison + 1);
+        if (!negated)
+            rotated.push_back(Make(I::NOT, I::constant, 0));
+        rotated.push_back(Make(I::ifGoto, I::constant, function[head].operand));
+        rotated.insert(rotated.end(), function.begin() + back + 1, function.end());
+        function.swap(rotated);
+        return true;
+    }
+    return false;
+}
+
+
+/* 'comparison, not, if-goto L1, then, goto L2, label L1, else, label L2' becomes
+ * 'comparison, if-goto L1, else, goto L2, label L1, then, label L2' */
+bool Optimiser::InvertBranch(Code &function) {
+    for (unsigned long n = 1; n + 1 < function.size(); n++) {
+        if (function[n].op != I::NOT || !IsComparison(function[n-1]) || function[n+1].op != I::ifGoto)
+            continue;
+        int l1 = function[n+1].operand;
+        unsigned long jump, elseStart = 0, end = 0;
+        if (JumpsTo(function, l1, jump) != 1)
+            continue;
+        for (unsigned long j = n + 2; j < function.size(); j++) {
+            if (function[j].op == I::label && function[j].operand == l1)
+                elseStart = j;
+        }
+        if (elseStart < n + 3 || function[elseStart-1].op != I::GOTO)
+            continue;
+        int l2 = function[elseStart-1].operand;
+        for (unsigned long j = elseStart + 1; j < function.size() && !end; j++) {
+            if (function[j].op == I::label && function[j].operand == l2)
+                end = j;
+        }
+        if (!end)
+            continue;
+
+        Code inverted(function.begin(), function.begin() + n);
+        inverted.push_back(function[n+1]);
+        inverted.insert(inverted.end(), function.begin() + elseStart + 1, function.begin() + end);
+        inverted.push_back(function[elseStart-1]);
+        inverted.push_back(function[elseStart]);
+        inverted.insert(inverted.end(), function.begin() + n + 2, function.begin() + elseStart - 1);
+        inverted.insert(inverted.end(), function.begin() + end, function.end());
+        function.swap(inverted);
+        return true;
+    }
+    return false;
+}
+
+
+/* Jumps to a label followed by a goto go to its target instead, a goto to a return
+ * returns, then the code after a goto or return up to the next label and the labels
+ * nothing jumps to are dropped. Returns true if anything changed. */
+bool Optimiser::ThreadFunctionJumps(Code &function) {
+    std::unordered_map <int, unsigned long> labels;
+    for (unsigned long j = 0; j < function.size(); j++) {
+        if (function[j].op == I::label)
+            labels[function[j].operand] = j;
+    }
+
+    bool changed = false;
+    for (I &jump: function) {
+        if (jump.op != I::GOTO && jump.op != I::ifGoto)
+            continue;
+        // Follow the gotos, a loop of them is left alone
+        std::unordered_set <int> seen = {jump.operand};
+        int label = jump.operand;
+        unsigned long target = function.size();
+        while (labels.count(label)) {
+            target = labels[label];
+            while (target < function.size() && function[target].op == I::label)
+                target++;
+            if (target >= function.size() || function[target].op != I::GOTO)
+                break;
+            label = function[target].operand;
+            if (!seen.insert(label).second) {
+                label = jump.operand;
+                target = function.size();
+                break;
+            }
+        }
+        if (label != jump.operand) {
+            jump.operand = label;
+            threadedJumps++;
+            changed = true;
+        }
+        if (jump.op == I::GOTO && target < function.size() && function[target].op == I::RETURN) {
+            jump = function[target];
+            threadedJumps++;
+            changed = true;
+        }
+    }
+
+    std::unordered_set <int> used;
+    for (const I &jump: function) {
+        if (jump.op == I::GOTO || jump.op == I::ifGoto)
+            used.insert(jump.operand);
+    }
+    unsigned long out = 0;
+    bool reachable = true;
+    for (unsigned long j = 0; j < function.size(); j++) {
+        const I &ins = function[j];
+        if (ins.op == I::label && !used.count(ins.operand)) {
+            removedLabels++;
+            changed = true;
+            continue;
+        }
+        if (ins.op == I::label || ins.op == I::function)
+            reachable = true;
+        if (!reachable) {
+            removedUnreachable++;
+            changed = true;
+            continue;
+        }
+        function[out++] = ins;
+        if (ins.op == I::GOTO || ins.op == I::RETURN)
+            reachable = false;
+    }
+    function.resize(out);
+    return changed;
+}
+
+
+/* Locals share a slot when they are never live at the same time, found with the
+ * liveness of each function's VM code. The slots are given out greedily in local
+ * order so a function keeps its first locals where they were, and the function
+ * pushes fewer zeros on entry. */
+void Optimiser::CoalesceLocals(Code &code) {
+    unsigned long i = 0;
+    while (i < code.size()) {
+        unsigned long end = i + 1;
+        while (end < code.size() && code[end].op != I::function)
+            end++;
+        if (code[i].op == I::function && code[i].count > 1)
+            CoalesceFunctionLocals(code, i, end);
+        i = end;
+    }
+}
+
+
+void Optimiser::CoalesceFunctionLocals(Code &code, unsigned long begin, unsigned long end) {
+    // A block starts at each label and after each jump or return
+    FlowGraph graph;
+    graph.Reset();
+    std::unordered_map <int, int> labels; // The block of each label
+    std::vector <int> blockOf(end - begin);
+    int block = graph.current;
+    bool empty = true;
+    for (unsigned long j = begin + 1; j < end; j++) {
+        if (code[j].op == I::label) {
+            if (!empty)
+                block = graph.NewBlock();
+            labels[code[j].operand] = block;
+        }
+        blockOf[j - begin] = block;
+        empty = code[j].op == I::label;
+        if (code[j].op == I::GOTO || code[j].op == I::ifGoto || code[j].op == I::RETURN) {
+            block = graph.NewBlock();
+            empty = true;
+        }
+    }
+
+    Token none;
+    for (unsigned long j = begin + 1; j < end; j++) {
+        const I &ins = code[j];
+        graph.current = blockOf[j - begin];
+        if (ins.segment == I::local && ins.op == I::push)
+            graph.Read(ins.operand, none);
+        else if (ins.segment == I::local && ins.op == I::pop)
+            graph.Write(ins.operand, none);
+        else if ((ins.op == I::GOTO || ins.op == I::ifGoto) && labels.count(ins.operand))
+            graph.AddEdge(graph.current, labels[ins.operand]);
+        bool next = j + 1 < end && blockOf[j + 1 - begin] != graph.current;
+        if (next && ins.op != I::GOTO && ins.op != I::RETURN)
+            graph.AddEdge(graph.current, blockOf[j + 1 - begin]);
+    }
+
+    int nLocals = code[begin].count;
+    std::vector <FlowGraph::BitSet> interferes = graph.Interference(nLocals);
+    std::vector <int> slots(nLocals, -1);
+    int nSlots = 0;
+    for (int v = 0; v < nLocals; v++) {
+        std::vector <bool> taken(nSlots, false);
+        for (int w = 0; w < v; w++) {
+            if ((interferes[v][w / 64] >> (w % 64)) & 1)
+                taken[slots[w]] = true;
+        }
+        slots[v] = 0;
+        while (slots[v] < nSlots && taken[slots[v]])
+            slots[v]++;
+        if (slots[v] == nSlots)
+            nSlots++;
+    }
+    if (nSlots == nLocals)
+        return;
+
+    coalescedLocals += nLocals - nSlots;
+    code[begin].count = nSlots;
+    for (unsigned long j = begin + 1; j < end; j++) {
+        if (code[j].segment == I::local && (code[j].op == I::push || code[j].op == I::pop))
+            code[j].operand = slots[code[j].operand];
+    }
+}
+
+
+/* A function returning the result of calling itself, 'call f n; return' inside f,
+ * reuses its own frame. The arguments are popped over the old ones, the locals are
+ * cleared like a call would, and it jumps back to a label after 'function f'. A call
+ * passing more or fewer arguments than f has parameters is only a warning, it is left
+ * alone since its arguments dont fit over the old ones. */
+void Optimiser::LoopTailCalls(Code &code, const std::unordered_map<int, int> &nParameters) {
+    int nextLabel = 0;
+    for (const I &i: code) {
+        if (i.op == I::label && i.operand >= nextLabel)
+            nextLabel = i.operand + 1;
+    }
+
+    Code looped;
+    looped.reserve(code.size());
+    unsigned long function = 0; // Of the current function in looped
+    int entryLabel = -1; // Not added yet
+    for (unsigned long i = 0; i < code.size(); i++) {
+        const I &call = code[i];
+        if (call.op == I::function) {
+            function = looped.size();
+            entryLabel = -1;
+        }
+        if (call.op != I::call || i + 1 >= code.size() || code[i+1].op != I::RETURN ||
+            looped.empty() || call.operand != looped[function].operand) {
+            looped.push_back(call);
+            continue;
+        }
+        std::unordered_map<int, int>::const_iterator parameters = nParameters.find(call.operand);
+        if (parameters == nParameters.end() || parameters->second != call.count) {
+            looped.push_back(call);
+            continue;
+        }
+
+        if (entryLabel < 0) {
+            entryLabel = nextLabel++;
+            looped.insert(looped.begin() + function + 1, Make(I::label, I::constant, entryLabel));
+        }
+        for (int a = call.count; a > 0; a--)
+            looped.push_back(Make(I::pop, I::argument, a - 1));
+        for (int l = 0; l < looped[function].count; l++) {
+            looped.push_back(Make(I::push, I::constant, 0));
+            looped.push_back(Make(I::pop, I::local, l));
+        }
+        looped.push_back(Make(I::GOTO, I::constant, entryLabel));
+        i++; // The return is never reached
+        loopedTailCalls++;
+    }
+    code.swap(looped);
+}
+
+
+/* The fields of the class in a file that are never read are dropped, the ones left
+ * are renumbered and the constructors, 'push constant n; call Memory.alloc 1;
+ * pop pointer 0', allocate less. Writes to a dropped field are popped to temp 0.
+ * Only for a class whose objects are never used as another type, and before any
+ * code from another class is inlined into the file. */
+void Optimiser::RemoveUnusedFields(Code &code) {
+    int nFields = -1; // Unless the class has a constructor
+    std::vector <bool> read;
+    for (unsigned long i = 0; i < code.size(); i++) {
+        if (i + 2 < code.size() && code[i].op == I::push && code[i].segment == I::constant &&
+            IsCall(code[i+1], I::alloc) && IsPop(code[i+2], I::pointer, 0))
+            nFields = code[i].operand;
+        if (code[i].op == I::push && code[i].segment == I::THIS) {
+            if (read.size() <= (unsigned long)code[i].operand)
+                read.resize(code[i].operand + 1, false);
+            read[code[i].operand] = true;
+        }
+    }
+    if (nFields <= 0 || read.size() > (unsigned long)nFields)
+        return;
+
+    read.resize(nFields, false);
+    std::vector <int> offsets(nFields, -1);
+    int kept = 0;
+    for (int f = 0; f < nFields; f++) {
+        if (read[f])
+            offsets[f] = kept++;
+    }
+    if (kept == nFields)
+        return;
+    removedFields += nFields - kept;
+
+    for (unsigned long i = 0; i < code.size(); i++) {
+        I &ins = code[i];
+        if (ins.segment == I::THIS && (ins.op == I::push || ins.op == I::pop)) {
+            if (offsets[ins.operand] < 0)
+                ins = Make(I::pop, I::temp, 0);
+            else
+                ins.operand = offsets[ins.operand];
+        }
+        else if (i + 2 < code.size() && IsPush(ins, I::constant, nFields) &&
+                 IsCall(code[i+1], I::alloc) && IsPop(code[i+2], I::pointer, 0))
+            ins.operand = kept > 0 ? kept : 1; // Memory.alloc wants at least a word
+    }
+}
+
+
+/* What pointer 0 and pointer 1 were set from is kept within a block, so setting one
+ * again from the same expression is dropped, 'a[i] + a[i]' only sets THAT once. The
+ * expression is forgotten once anything it reads is written or at any label, jump or
+ * call. A function that never reads this doesnt need pointer 0 set at all, a method
+ * prologue 'push argument 0; pop pointer 0' is dropped then. */
+void Optimiser::TrackPointers(Code &code) {
+    Code tracked;
+    tracked.reserve(code.size());
+    Code pointers[2]; // The expression each pointer was set from, empty if not known
+    bool usesThis = true;
+    for (unsigned long i = 0; i < code.size(); i++) {
+        const I &ins = code[i];
+        if (ins.op == I::function) {
+            usesThis = false;
+            for (unsigned long j = i + 1; j < code.size() && code[j].op != I::function; j++) {
+                if (code[j].segment == I::THIS && (code[j].op == I::push || code[j].op == I::pop))
+                    usesThis = true;
+                if (IsPush(code[j], I::pointer, 0))
+                    usesThis = true;
+            }
+        }
+
+        if (ins.op == I::pop && ins.segment == I::pointer) {
+            Code &pointer = pointers[ins.operand];
+            unsigned long start = PureAddressBefore(tracked, tracked.size());
+            if (start < tracked.size() && ((ins.operand == 0 && !usesThis) ||
+                (tracked.size() - start == pointer.size() &&
+                 std::equal(pointer.begin(), pointer.end(), tracked.begin() + start, Same)))) {
+                tracked.resize(start);
+                elidedPointerLoads++;
+                continue;
+            }
+            pointer.assign(tracked.begin() + start, tracked.end());
+            if (ins.operand == 0) {
+                for (Code &p: pointers)
+                    ForgetReads(p, I::THIS, -1);
+            }
+        }
+        else if (ins.op == I::pop) {
+            // Writing through this or that could change any field
+            bool memory = ins.segment == I::THIS || ins.segment == I::that;
+            for (Code &pointer: pointers) {
+                ForgetReads(pointer, ins.segment, ins.operand);
+                if (memory)
+                    ForgetReads(pointer, I::THIS, -1);
+            }
+        }
+        else if (ins.op != I::push && ins.op != I::add && ins.op != I::sub && ins.op != I::neg &&
+                 ins.op != I::eq && ins.op != I::gt && ins.op != I::lt && ins.op != I::AND &&
+                 ins.op != I::OR && ins.op != I::NOT) {
+            pointers[0].clear();
+            pointers[1].clear();
+        }
+        tracked.push_back(ins);
+    }
+    code.swap(tracked);
+}
+
+
+/* Whole program, keep only the functions reachable from the roots through calls.
+ * Methods and constructors are called by their full name like functions, so the call
+ * instructions are the whole call graph. Calls to functions the program doesnt
+ * define, the JackOS ones, are left alone. */
+void Optimiser::RemoveDeadFunctions(std::vector<Code*> &files, const std::vector<int> &roots) {
+    // Where each function is, its file and the range of its instructions
+    typedef struct {
+        Code *file;
+        unsigned long begin;
+        unsigned long end;
+    } location;
+    std::unordered_map <int, location> functions;
+    for (Code *file: files) {
+        for (unsigned long i = 0; i < file->size(); i++) {
+            if ((*file)[i].op != I::function)
+                continue;
+            unsigned long end = i + 1;
+            while (end < file->size() && (*file)[end].op != I::function)
+                end++;
+            location l = {file, i, end};
+            functions[(*file)[i].operand] = l;
+        }
+    }
+
+    std::unordered_set <int> reached;
+    std::vector <int> worklist;
+    for (int root: roots) {
+        if (functions.count(root) && reached.insert(root).second)
+            worklist.push_back(root);
+    }
+    while (!worklist.empty()) {
+        location l = functions[worklist.back()];
+        worklist.pop_back();
+        for (unsigned long i = l.begin; i < l.end; i++) {
+            int callee = (*l.file)[i].operand;
+            if ((*l.file)[i].op == I::call && functions.count(callee) &&
+                reached.insert(callee).second)
+                worklist.push_back(callee);
+        }
+    }
+
+    // Compact each file, a function is copied along with its instructions
+    for (Code *file: files) {
+        unsigned long out = 0;
+        bool keep = true;
+        for (unsigned long i = 0; i < file->size(); i++) {
+            if ((*file)[i].op == I::function) {
+                keep = reached.count((*file)[i].operand) > 0;
+                if (!keep)
+                    removedFunctions++;
+            }
+            if (keep)
+                (*file)[out++] = (*file)[i];
+        }
+        file->resize(out);
+    }
+}
+
+
+/* Whole program, splice small functions into the places that call them. Only leaf
+ * functions are inlined, ones that call nothing, so they cant be recursive and an
+ * inlined body never needs inlining itself. Each call site gets the body plus the
+ * moves of the arguments and locals, and saves a call and return, INLINE_CALL_COST.
+ * A function is inlined if that never grows the code, or if what it grows by over all
+ * its call sites is at most INLINE_MAX_GROWTH, so a bigger body is still inlined when
+ * it is only called once or twice. */
+void Optimiser::InlineCalls(std::vector<Code*> &files) {
+    std::unordered_map <int, int> callSites, nArgs;
+    for (Code *file: files) {
+        for (const I &i: *file) {
+            if (i.op == I::call) {
+                callSites[i.operand]++;
+                nArgs[i.operand] = i.count;
+            }
+        }
+    }
+
+    std::unordered_map <int, Code> inlinable; // A copy of each function, files are rewritten
+    std::unordered_map <int, const Code*> staticsOf; // Statics are numbered per file
+    for (Code *file: files) {
+        for (unsigned long i = 0; i < file->size(); i++) {
+            if ((*file)[i].op != I::function)
+                continue;
+            unsigned long end = i + 1;
+            bool leaf = true, usesStatics = false;
+            while (end < file->size() && (*file)[end].op != I::function) {
+                if ((*file)[end].op == I::call)
+                    leaf = false;
+                if ((*file)[end].segment == I::STATIC && ((*file)[end].op == I::push || (*file)[end].op == I::pop))
+                    usesStatics = true;
+                end++;
+            }
+            int function = (*file)[i].operand;
+            long size = end - i - 1 + nArgs[function] + 2 * (*file)[i].count;
+            long growth = (size - INLINE_CALL_COST) * callSites[function];
+            if (leaf && callSites[function] > 0 && growth <= INLINE_MAX_GROWTH) {
+                inlinable[function] = Code(file->begin() + i, file->begin() + end);
+                if (usesStatics)
+                    staticsOf[function] = file;
+            }
+        }
+    }
+    if (inlinable.empty())
+        return;
+
+    for (Code *file: files) {
+        // Inlined labels are numbered after every label of the file
+        int nextLabel = 0;
+        for (const I &i: *file) {
+            if (i.op == I::label && i.operand >= nextLabel)
+                nextLabel = i.operand + 1;
+        }
+
+        Code out;
+        out.reserve(file->size());
+        unsigned long function = 0; // Of the caller in out
+        int callerLocals = 0; // Before anything was inlined into it
+        bool usesThis = false;
+        for (unsigned long i = 0; i < file->size(); i++) {
+            const I &call = (*file)[i];
+            if (call.op == I::function) {
+                function = out.size();
+                callerLocals = call.count;
+                // Does the caller rely on pointer 0 being kept
+                usesThis = false;
+                for (unsigned long j = i + 1; j < file->size() && (*file)[j].op != I::function; j++) {
+                    if ((*file)[j].segment == I::THIS || IsPush((*file)[j], I::pointer, 0))
+                        usesThis = (*file)[j].op == I::push || (*file)[j].op == I::pop;
+                    if (usesThis)
+                        break;
+                }
+            }
+            std::unordered_map<int, Code>::const_iterator it;
+            std::unordered_map<int, const Code*>::const_iterator owner;
+            if (call.op != I::call || (it = inlinable.find(call.operand)) == inlinable.end() ||
+                ((owner = staticsOf.find(call.operand)) != staticsOf.end() && owner->second != file)) {
+                out.push_back(call);
+                continue;
+            }
+
+            /* The arguments and locals of the callee become extra locals of the caller,
+             * after its own, reused by every call inlined into it */
+            const Code &callee = it->second;
+            unsigned long begin = 0;
+            int nArgs = call.count, nLocals = callee[begin].count;
+            int argumentBase = callerLocals, localBase = callerLocals + nArgs;
+            int saveThis = localBase + nLocals;
+            bool setsThis = false;
+            unsigned long end = begin + 1;
+            for (; end < callee.size() && callee[end].op != I::function; end++) {
+                if (IsPop(callee[end], I::pointer, 0))
+                    setsThis = true;
+            }
+            bool keepThis = setsThis && usesThis;
+            int needed = nArgs + nLocals + (keepThis ? 1 : 0);
+            if (callerLocals + needed > out[function].count)
+                out[function].count = callerLocals + needed;
+
+            for (int a = nArgs; a > 0; a--)
+                out.push_back(Make(I::pop, I::local, argumentBase + a - 1));
+            for (int l = 0; l < nLocals; l++) {
+                out.push_back(Make(I::push, I::constant, 0));
+                out.push_back(Make(I::pop, I::local, localBase + l));
+            }
+            if (keepThis) {
+                out.push_back(Make(I::push, I::pointer, 0));
+                out.push_back(Make(I::pop, I::local, saveThis));
+            }
+
+            // The callee labels are renumbered, its returns jump to the end of the body
+            std::unordered_map <int, int> labels;
+            int endLabel = nextLabel++;
+            bool jumpsToEnd = false;
+            for (unsigned long j = begin + 1; j < end; j++) {
+                I b = callee[j];
+                if (b.op == I::RETURN) {
+                    if (j == end - 1)
+                        continue; // Falls through to the end
+                    b = Make(I::GOTO, I::constant, endLabel);
+                    jumpsToEnd = true;
+                }
+                else if (b.op == I::label || b.op == I::GOTO || b.op == I::ifGoto) {
+                    if (!labels.count(b.operand))
+                        labels[b.operand] = nextLabel++;
+                    b.operand = labels[b.operand];
+                }
+                else if ((b.op == I::push || b.op == I::pop) && b.segment == I::argument) {
+                    b.segment = I::local;
+                    b.operand += argumentBase;
+                }
+                else if ((b.op == I::push || b.op == I::pop) && b.segment == I::local)
+                    b.operand += localBase;
+                out.push_back(b);
+            }
+            if (jumpsToEnd)
+                out.push_back(Make(I::label, I::constant, endLabel));
+
+            if (keepThis) {
+                out.push_back(Make(I::push, I::local, saveThis));
+                out.push_back(Make(I::pop, I::pointer, 0));
+            }
+            inlinedCalls++;
+        }
+        file->swap(out);
+    }
+}
+
+
+void Optimiser::PrintStats() {
+    std::cout << "fold constants: " << foldedConstants << std::endl;
+    std::cout << "eliminate common subexpressions: " << eliminatedSubexpressions << std::endl;
+    std::cout << "hoist loop invariants: " << hoistedInvariants << std::endl;
+    std::cout << "reduce induction variables: " << reducedInductionVariables << std::endl;
+    std::cout << "reduce multiplications: " << reducedMultiplications << std::endl;
+    std::cout << "rotate loops: " << rotatedLoops << std::endl;
+    std::cout << "invert branches: " << invertedBranches << std::endl;
+    std::cout << "thread jumps: " << threadedJumps << std::endl;
+    std::cout << "remove unreachable instructions: " << removedUnreachable << std::endl;
+    std::cout << "remove labels: " << removedLabels << std::endl;
+    std::cout << "loop tail calls: " << loopedTailCalls << std::endl;
+    std::cout << "remove unused fields: " << removedFields << std::endl;
+    std::cout << "elide pointer loads: " << elidedPointerLoads << std::endl;
+    std::cout << "coalesce locals: " << coalescedLocals << std::endl;
+    std::cout << "inline calls: " << inlinedCalls << std::endl;
+    std::cout << "remove dead functions: " << removedFunctions << std::endl;
+    for (unsigned long p = 0; p < nPatterns; p++)
+        std::cout << "peephole " << patterns[p].name << ": " << peepholeHits[p] << std::endl;
+}
@@ -0,0 +1,73 @@
+#ifndef OPTIMISER_H
+#define OPTIMISER_H
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include "VmCode.h"
+
+/****************** Optimiser class definitions *****************/
+/* Rewrites the VM code of a function once the whole program has been checked, keeps
+ * a count of every rewrite it does so the passes can be compared */
+class Optimiser {
+public:
+    typedef std::vector <VmInstruction> Code;
+
+    /* A peephole pattern, matched against the last 'length' instructions written,
+     * rewrite replaces them with fewer instructions and returns how many */
+    typedef struct {
+        const char *name;
+        unsigned long length;
+        bool (*match)(const VmInstruction *code);
+        unsigned long (*rewrite)(const VmInstruction *code, VmInstruction *out);
+    } pattern;
+
+private:
+    std::vector <unsigned long> peepholeHits; // For each pattern
+    unsigned long foldedConstants;
+    unsigned long reducedMultiplications;
+    unsigned long removedFunctions;
+    unsigned long inlinedCalls;
+    unsigned long loopedTailCalls;
+    unsigned long removedFields;
+    unsigned long elidedPointerLoads;
+    unsigned long eliminatedSubexpressions;
+    unsigned long hoistedInvariants;
+    unsigned long reducedInductionVariables;
+    unsigned long rotatedLoops;
+    unsigned long invertedBranches;
+    unsigned long threadedJumps;
+    unsigned long removedUnreachable;
+    unsigned long removedLabels;
+    unsigned long coalescedLocals;
+
+public:
+    Optimiser();
+    void Peephole(Code &code);
+    void EliminateCommonSubexpressions(Code &code);
+    void HoistLoopInvariants(Code &code);
+    void ReduceInductionVariables(Code &code);
+    void ReduceMultiplications(Code &code);
+    void ThreadJumps(Code &code);
+    void LoopTailCalls(Code &code, const std::unordered_map<int, int> &nParameters);
+    void TrackPointers(Code &code);
+    void CoalesceLocals(Code &code);
+    void RemoveUnusedFields(Code &code);
+    void RemoveDeadFunctions(std::vector<Code*> &files, const std::vector<int> &roots);
+    void InlineCalls(std::vector<Code*> &files);
+    void PrintStats();
+
+private:
+    bool PeepholeSweep(Code &code);
+    bool FoldConstant(Code &code, unsigned long &out);
+    bool ReduceMultiplication(Code &code);
+    bool EliminateCommonSubexpression(Code &block, int &nextHidden);
+    bool HoistLoopInvariant(Code &function);
+    bool ReduceInductionVariable(Code &function);
+    bool RotateLoop(Code &function, int &nextLabel);
+    bool InvertBranch(Code &function);
+    bool ThreadFunctionJumps(Code &function);
+    void CoalesceFunctionLocals(Code &code, unsigned long begin, unsigned long end);
+};
+
+#endif
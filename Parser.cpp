@@ -2,17 +2,35 @@
 #include <vector>
 #include <dirent.h>
 #include <sstream>
+#include <thread>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "CompilerHeaders.h"
 
 Parser::Parser() {
     SymbolTable s;
     symbolTables.push_back(s);
     currentSymbolTable = 0; // Program SymbolTable i.e. across files
+
+    // Intern the types the compatibility rules single out, in builtinType order
+    std::string builtinTypeNames[] = {"", "void", "int", "char", "boolean", "null",
+                                      "ArrayEntry", "Array"};
+    for (const std::string &name: builtinTypeNames)
+        InternType(name);
+    BuildCompatibility();
+
+    // Intern the functions the optimiser singles out, in builtinName order
+    InternName("Math.multiply");
+    InternName("Math.divide");
+    InternName("Memory.alloc");
 }
 
 
 // Initialise the lexer and produce the tokens
 bool Parser::Init(std::string filename) {
+    currentSourceFile = filename;
     if(l.ExtractSourceFile(filename)) {
         if (l.ProduceTokens()) {
             return true;
@@ -70,225 +88,322 @@ void Parser::AddJackOS() {
 
 // Calls all the semantic checks functions and issues errors/warnings at the end
 void Parser::ResolveAllDeclars() {
+    BuildSymbolIndex();
     // Some expressions contain function calls, so resolve the call to its return type
-    /* Im treating field and static variables as subroutines because they are
-     * accessed using '.' operator same as subroutines */
-    for (Symbol s: symbolTables[0].table) {
+    ResolveSubroutinesReturnType();
+    /* When writing code for calls I write extra pop statements after each
+     * call for void functions, if the call wasnt for a void function I remove it */
+    RemovePopCode();
+
+    /* Every declaration is checked on its own against the read-only index, so the
+     * declaration lists are split in shards and checked by a pool of threads */
+    unsigned long nDeclars = varDeclarations.size() + subroutineCalls.size() +
+                             assignments.size() + returns.size() + arrayIndices.size();
+    unsigned int nShards = std::thread::hardware_concurrency();
+    if (nShards == 0 || nDeclars / MIN_DECLARS_PER_SHARD < nShards)
+        nShards = nDeclars / MIN_DECLARS_PER_SHARD + 1;
+    std::vector <shard> shards(nShards);
+    std::vector <std::thread> pool;
+    for (unsigned int i=0; i < nShards; i++) {
+        shards[i].index = i;
+        shards[i].count = nShards;
+        if (i > 0)
+            pool.push_back(std::thread(&Parser::CheckShard, this, std::ref(shards[i])));
+    }
+    CheckShard(shards[0]);
+    for (std::thread &t: pool)
+        t.join();
+
+    for (const shard &s: shards)
+        aliasedTypes.insert(s.aliasedTypes.begin(), s.aliasedTypes.end());
+    ReportDiagnostics(shards);
+}
+
+
+/* Index the program SymbolTable once so every declaration is resolved with a hash
+ * lookup. Im treating field and static variables as subroutines because they are
+ * accessed using '.' operator same as subroutines */
+void Parser::BuildSymbolIndex() {
+    for (const Symbol &s: symbolTables[0].table) {
         if (s.kind == Symbol::subroutine || s.kind == Symbol::field ||
             s.kind == Symbol::STATIC) {
-            ResolveSubroutinesReturnType(subroutineCalls, s);
-            ResolveSubroutinesReturnType(assignments, s);
-            ResolveSubroutinesReturnType(returns, s);
-            ResolveSubroutinesReturnType(arrayIndices, s);
-            /* When writing code for calls I write extra pop statements after each
-             * call for void functions, if the call wasnt for a void function I remove it */
-            RemovePopCode(s);
+            members.insert({s.name, &s});
+            /* Call arguments are checked against the last declaration with the
+             * same number of arguments, so later symbols overwrite earlier ones */
+            std::string nArgs = "/" + std::to_string(s.arguments.size());
+            calls[s.name] = &s;
+            calls[s.name + nArgs] = &s;
+            calls[s.type + "." + s.name] = &s;
+            calls[s.type + "." + s.name + nArgs] = &s;
+            // Intern the argument types now, the shards only read the types
+            for (const std::string &type: s.arguments)
+                InternType(type);
         }
+        else if (s.kind == Symbol::identifier && s.name != "Main")
+            classNames.insert(s.name); // Main is not a valid type
     }
+}
 
-    // Evaluate all the expressions found in the program
-    EvaluateExpressions(subroutineCalls); // expressions found in calls
-    EvaluateExpressions(assignments); // expressions found in assignments
-    EvaluateExpressions(returns); // expressions found in return statements
-    EvaluateExpressions(arrayIndices); // expressions found in array indices
-    CheckReturnsCompatibility();
-    CheckArrayIndices();
 
-    /* Resolve all variable declarations with identifier types and all subroutine
-     * calls using the program SymbolTable */
-    for (Symbol s: symbolTables[0].table) {
-        if (s.kind == Symbol::subroutine || s.kind == Symbol::field ||
-            s.kind == Symbol::STATIC)
-            ResolveSubroutineCall(s);
-        else if (s.kind == Symbol::identifier)
-            ResolveVarDeclar(s.name);
+// Check the slice of every declaration list that belongs to the shard
+void Parser::CheckShard(shard &s) {
+    std::vector <declaration> *lists[] = {&varDeclarations, &subroutineCalls,
+                                          &assignments, &returns, &arrayIndices};
+    for (s.list = 0; s.list < 5; s.list++) {
+        std::vector <declaration> &v = *lists[s.list];
+        unsigned long end = v.size() * (s.index + 1) / s.count;
+        for (s.position = v.size() * s.index / s.count; s.position < end; s.position++) {
+            declaration &d = v[s.position];
+            // Evaluate all the expressions found in the program
+            EvaluateExpression(s, d);
+            if (lists[s.list] == &varDeclarations)
+                ResolveVarDeclar(s, d);
+            else if (lists[s.list] == &subroutineCalls)
+                ResolveSubroutineCall(s, d);
+            else if (lists[s.list] == &assignments)
+                CheckAssignmentCompatibility(s, d);
+            else if (lists[s.list] == &returns)
+                CheckReturnCompatibility(s, d);
+            else
+                CheckArrayIndex(s, d);
+        }
     }
+}
 
-    // Check if assignments LHS and RHS are compatible
-    for (declaration &d: assignments) {
-        bool compatible = CheckCompatibility(d.LHS, d.RHS);
-        if (compatible)
-            d.argsMatch = true;
-    }
 
-    // Error report for any variable not resolved
-    for (declaration d: varDeclarations) {
-        if (!d.resolved)
-            ResolveError(d, "Unknown type '" + d.type + "'.");
-    }
+// Resolve identifier types found against the class names of the program.
+void Parser::ResolveVarDeclar(shard &s, declaration &d) {
+    if (classNames.count(d.type))
+        d.resolved = true;
+    else // Error report for any variable not resolved
+        ResolveError(s, d, "Unknown type '" + d.type + "'.");
+}
 
-    // Error report for any subroutine call not resolved, or call arguments not matching
-    for (declaration d: subroutineCalls) {
-        if (d.type.empty()) { // I dont store types for methods and functions
-            if (d.resolved && !d.argsMatch)
-                ResolveWarning(d, "call arguments do not match subroutine declaration.");
-            else if (!d.resolved)
-                ResolveError(d, "Unknown subroutine '" + d.name + "()'.");
+
+/* Resolve a subroutine call found, constructors are seperated from functions
+ * and methods because their type is stored. */
+void Parser::ResolveSubroutineCall(shard &sh, declaration &d) {
+    /* If the subroutine call has a type (Type is the class name), means its a
+     * constructor. (I am only storing call types for constructors, implementation choice) */
+    std::string key = d.type.empty() ? d.name : d.type + "." + d.name;
+    if (calls.find(key) != calls.end()) {
+        d.resolved = true; // Subroutine is found in the program ST.
+
+        // Match argument size
+        SymbolIndex::const_iterator it = calls.find(key + "/" + std::to_string(d.arguments.size()));
+        if (it != calls.end()) {
+            const Symbol &s = *it->second;
+            d.argsMatch = true; // Assume arguments match to start with
+            for (unsigned int j=0; j < d.arguments.size(); j++) {
+                TypeId parameter = typeIds.at(s.arguments[j]); // Interned with the index
+                if (d.name != "deAlloc") // Memory.deAlloc only gives the block back
+                    CheckAliasing(sh, parameter, d.arguments[j]);
+                if (d.arguments[j] != parameter) {
+                    bool compatible = CheckCompatibility(parameter, d.arguments[j]);
+                    if (!compatible)
+                        d.argsMatch = false;
+                }
+            }
         }
-        else { // constructor
-            if (d.resolved && !d.argsMatch)
-                ResolveWarning(d, "call arguments do not match constructor declaration.");
-            else if (!d.resolved)
-                ResolveError(d, "Unknown constructor '" + d.type + "." + d.name + "()'.");
+        else { // Warned about below, the parameter types are not known
+            for (TypeId argument: d.arguments)
+                CheckAliasing(sh, noType, argument);
         }
     }
 
-    // Generate warnings for any incompatible assignment statement
-    // Cant be too strict and issue it as an error because of Jack
-    for (declaration d: assignments) {
-        if (!d.argsMatch)
-            ResolveWarning(d, "The type '" + d.LHS + "' is not compatible with '" + d.RHS + "'.");
+    // Error report for any subroutine call not resolved, or call arguments not matching
+    if (d.type.empty()) { // I dont store types for methods and functions
+        if (d.resolved && !d.argsMatch)
+            ResolveWarning(sh, d, "call arguments do not match subroutine declaration.");
+        else if (!d.resolved)
+            ResolveError(sh, d, "Unknown subroutine '" + d.name + "()'.");
+    }
+    else { // constructor
+        if (d.resolved && !d.argsMatch)
+            ResolveWarning(sh, d, "call arguments do not match constructor declaration.");
+        else if (!d.resolved)
+            ResolveError(sh, d, "Unknown constructor '" + d.type + "." + d.name + "()'.");
     }
+}
+
 
-    // Generate warnings for any incompatible return statement
-    // Cant be too strict and issue it as an error because of Jack
-    for (declaration d: returns) {
-        if (!d.argsMatch)
-            ResolveWarning(d, "The type '" + d.type + "' is not compatible with " + d.arguments[0] + "'.");
+/* Some expressions have subroutine calls inside of them, resolve every called name
+ * to its return type to be able to evaluate the expressions compatibility. */
+void Parser::ResolveSubroutinesReturnType() {
+    resolvedCalls.resize(calledNames.size());
+    for (unsigned int i=0; i < calledNames.size(); i++) {
+        SymbolIndex::const_iterator it = members.find(calledNames[i]);
+        if (it != members.end())
+            resolvedCalls[i] = InternType(it->second->type);
+        else
+            resolvedCalls[i] = InternType(calledNames[i]); // Reported when resolving calls
     }
 }
 
 
-/* Resolve identifier types found, Main is stored as a class in the program Symbol
- * table so skip it as its not a valid type. */
-void Parser::ResolveVarDeclar(std::string type) {
-    for (declaration &d: varDeclarations) {
-        if (type == "Main")
-            continue;
-        else if (d.type == type)
-            d.resolved = true;
-    }
+/* Generate warnings for any incompatible assignment statement
+ * Cant be too strict and issue it as an error because of Jack */
+void Parser::CheckAssignmentCompatibility(shard &s, declaration &d) {
+    CheckAliasing(s, d.LHS, d.exprType);
+    bool compatible = CheckCompatibility(d.LHS, d.exprType);
+    if (compatible)
+        d.argsMatch = true;
+    else
+        ResolveWarning(s, d, "The type '" + TypeName(d.LHS) + "' is not compatible with '" +
+                             TypeName(d.exprType) + "'.");
 }
 
 
-/* Resolve all subroutine calls found, constructors are seperated from functions
- * and methods because their type is stored. */
-void Parser::ResolveSubroutineCall(Symbol s) {
-    for (unsigned int i=0; i < subroutineCalls.size(); i++) {
-        if (subroutineCalls[i].type.empty()) { // means its a function or method
-            if (subroutineCalls[i].name == s.name) { // Match subroutine name first
-                subroutineCalls[i].resolved = true; // Subroutine is found in the program ST.
-                if (subroutineCalls[i].arguments.size() == s.arguments.size()) { // Match argument size
-                    subroutineCalls[i].argsMatch = true; // Assume arguments match to start with
-                    for (unsigned int j=0; j < subroutineCalls[i].arguments.size(); j++) {
-                        if (subroutineCalls[i].arguments[j] != s.arguments[j]) {
-                            bool compatible;
-                            compatible = CheckCompatibility(s.arguments[j], subroutineCalls[i].arguments[j]);
-                            if (!compatible)
-                                subroutineCalls[i].argsMatch = false;
-                        }
-                    }
-                }
-            }
-        }
-        else {
-            /* If the subroutine call has a type (Type is the class name), means
-             * its a constructor. (I am only storing call types for constructors,
-             * implementation choice) */
-            if ((subroutineCalls[i].name == s.name) && (subroutineCalls[i].type == s.type)) {
-                subroutineCalls[i].resolved = true; // Subroutine is found in the program ST.
-                if (subroutineCalls[i].arguments.size() == s.arguments.size()) { // Match argument size
-                    subroutineCalls[i].argsMatch = true; // Assume arguments match to start with
-                    for (unsigned int j=0; j < subroutineCalls[i].arguments.size(); j++) {
-                        if (subroutineCalls[i].arguments[j] != s.arguments[j]) {
-                            bool compatible = CheckCompatibility(s.arguments[j], subroutineCalls[i].arguments[j]);
-                            if (!compatible)
-                                subroutineCalls[i].argsMatch = false;
-                        }
-                    }
-                }
-            }
-        }
-    }
+/* The type of the return expression is compared for compatibility, none means void.
+ * Cant be too strict and issue it as an error because of Jack */
+void Parser::CheckReturnCompatibility(shard &s, declaration &d) {
+    CheckAliasing(s, d.LHS, d.exprType);
+    bool compatible = CheckCompatibility(d.LHS, d.exprType);
+    if (compatible)
+        d.argsMatch = true;
+    else
+        ResolveWarning(s, d, "The type '" + d.type + "' is not compatible with " +
+                             TypeName(d.exprType) + "'.");
 }
 
 
-/* Some expressions have subroutine calls inside of them, resolve them to their
- * type to be able to evaluate the expressions compatibility. */
-void Parser::ResolveSubroutinesReturnType(std::vector<declaration> &list, Symbol s) {
-    for (declaration &d: list) {
-        for (std::string &t: d.arguments) {
-            if (t == s.name)
-                t = s.type;
+/* For the semantic check array index must evaluate to 'int', only the 'int' or
+ * 'char' or 'ArrayEntry' types are allowed. */
+void Parser::CheckArrayIndex(shard &s, declaration &d) {
+    if (d.exprType != intType && d.exprType != charType && d.exprType != arrayEntryType)
+        ResolveError(s, d, "Array index must evaluate to an 'int' value.");
+}
+
+
+/* Evaluate an expression, the operators whose operand types could not be checked
+ * while parsing are checked now and reported if incompatible. The expression and
+ * argument types are then resolved to the subroutines return types. */
+void Parser::EvaluateExpression(shard &s, declaration &d) {
+    for (const operation &o: d.operations) {
+        bool compatible = CheckCompatibility(ResolveType(o.left), ResolveType(o.right));
+        if (!compatible) {
+            ResolveError(s, d, "Cant perform operation '" + o.op + "' on non compatible types '" +
+              TypeName(o.left) + "' and '" + TypeName(o.right) + "'.");
         }
     }
+    d.exprType = ResolveType(d.exprType);
+    for (TypeId &t: d.arguments)
+        t = ResolveType(t);
 }
 
 
-/* The return expression is stored in arguments, the type of the expression is left in
- * arguments[0] after it is evaluated so compare for compatibility. */
-void Parser::CheckReturnsCompatibility() {
-    for (declaration &d: returns) {
-        bool compatible;
-        if (d.arguments.size() == 0) // no return type, means void
-            compatible = CheckCompatibility(d.type, "");
-        else
-            compatible = CheckCompatibility(d.type, d.arguments[0]);
+Parser::TypeId Parser::InternType(const std::string &name) {
+    std::unordered_map<std::string, TypeId>::iterator it = typeIds.find(name);
+    if (it != typeIds.end())
+        return it->second;
+    typeNames.push_back(name);
+    return typeIds[name] = typeNames.size() - 1;
+}
+
+
+// The type of a call is only known at the end, so it refers to the called name
+Parser::TypeId Parser::InternCall(const std::string &name) {
+    std::unordered_map<std::string, TypeId>::iterator it = calledIds.find(name);
+    if (it != calledIds.end())
+        return ~it->second;
+    calledNames.push_back(name);
+    calledIds[name] = calledNames.size() - 1;
+    return ~calledIds[name];
+}
+
+
+// Only valid after ResolveSubroutinesReturnType
+Parser::TypeId Parser::ResolveType(TypeId type) {
+    if (type < 0)
+        return resolvedCalls[~type];
+    return type;
+}
+
+
+const std::string &Parser::TypeName(TypeId type) {
+    if (type < 0 && resolvedCalls.size() <= (unsigned int)~type)
+        return calledNames[~type]; // Not resolved yet
+    return typeNames[ResolveType(type)];
+}
 
-        if (compatible)
-            d.argsMatch = true;
+
+/* Pop both operand types of a binary operator and push the type it evaluates to,
+ * the left operand type or boolean for relational operators. Operands with a call
+ * type are checked once every class is parsed. */
+void Parser::EvaluateOperator(const std::string &op) {
+    TypeId right = typeStack.back();
+    typeStack.pop_back();
+    TypeId left = typeStack.back();
+    if (left < 0 || right < 0 || !CheckCompatibility(left, right)) {
+        operation o = {op, left, right};
+        operations.push_back(o);
     }
+    if (op == "=" || op == "<" || op == ">")
+        typeStack.back() = booleanType;
 }
 
 
-/* For the semantic check array index must evaluate to 'int', only the 'int' or
- * 'char' or 'ArrayEntry' types are allowed. */
-void Parser::CheckArrayIndices() {
-    for (declaration &d: arrayIndices) {
-        if (d.arguments[0] != "int" && d.arguments[0] != "char" &&
-            d.arguments[0] != "ArrayEntry")
-            ResolveError(d, "Array index must evaluate to an 'int' value.");
-    }
-}
-
-
-/* Evaluate expressions, every time an operator is encountered both sides of it
- * are checked for type compatibility and deleted, reported if incompatible. */
-void Parser::EvaluateExpressions(std::vector<Parser::declaration> &v) {
-    for (unsigned int i=0; i < v.size(); i++) {
-        for (unsigned int j=0; j < v[i].arguments.size(); j++) {
-            if (v[i].arguments[j] == "*" || v[i].arguments[j] == "/" ||
-                v[i].arguments[j] == "+" || v[i].arguments[j] == "-" ||
-                v[i].arguments[j] == "<" || v[i].arguments[j] == ">" ||
-                v[i].arguments[j] == "=") {
-                bool compatible = CheckCompatibility(v[i].arguments[j-1], v[i].arguments[j+1]);
-                if (compatible) {
-                    v[i].arguments.erase(v[i].arguments.begin() + j); // Delete the operator
-                    v[i].arguments.erase(v[i].arguments.begin() + j);  // Delete the type
-                    j=0; // Reset the counter because something got deleted
-                }
-                else {
-                    ResolveError(v[i], "Cant perform operation '" + v[i].arguments[j] +
-                      "' on non compatible types '" + v[i].arguments[j-1] + "' and '" +
-                      v[i].arguments[j+1] + "'.");
-                }
-            }
+/* Pop the type of the expression just parsed, the operations deferred since 'mark'
+ * belong to the declaration the expression is stored in. */
+Parser::TypeId Parser::PopExpression(declaration &d, unsigned long mark) {
+    d.operations.insert(d.operations.end(), operations.begin() + mark, operations.end());
+    operations.resize(mark);
+    TypeId type = typeStack.back();
+    typeStack.pop_back();
+    return type;
+}
+
+
+/* The ruleset of types compatibility, precomputed for the builtin types and for
+ * classType which stands for any two different classes. */
+void Parser::BuildCompatibility() {
+    for (int t1 = 0; t1 <= classType; t1++) {
+        compatibility[t1] = 0;
+        for (int t2 = 0; t2 <= classType; t2++) {
+            bool compatible = false;
+            if ((t1 == intType || t1 == charType) && (t2 == intType || t2 == charType))
+                compatible = true;
+            else if (t1 == booleanType && t2 == booleanType)
+                compatible = true;
+            else if (t2 == nullType)
+                compatible = true;
+            else if (t1 == arrayEntryType || t2 == arrayEntryType)
+                compatible = true;
+            else if (t1 == arrayType) // because array is like the "object" class
+                compatible = true;
+            else if (t1 == voidType && t2 == noType)
+                compatible = true;
+            else if (t1 == t2 && t1 != classType)
+                compatible = true;
+
+            if (compatible)
+                compatibility[t1] |= 1 << t2;
         }
-        // For LHS and RHS compatibility
-        if (!v[i].arguments.empty())
-            v[i].RHS = v[i].arguments[0];
     }
 }
 
 
-// The ruleset of types compatibility, all checks use this function.
-bool Parser::CheckCompatibility(std::string t1, std::string t2) {
-    if ((t1 == "int" || t1 == "char") && (t2 == "int" || t2 == "char"))
-        return true;
-    else if (t1 == "boolean" && t2 == "boolean")
-        return true;
-    else if (t2 == "null")
-        return true;
-    else if (t1 == "ArrayEntry" || t2 == "ArrayEntry")
+// All checks use this function, a type is always compatible with itself.
+bool Parser::CheckCompatibility(TypeId t1, TypeId t2) {
+    if (t1 == t2)
         return true;
-    else if (t1 == "Array") // because array is like the "object" class
-        return true;
-    else if (t1 == "void" && t2.empty())
-        return true;
-    else if (t1 == t2)
-        return true;
-    else
-        return false;
+    int row = t1 < classType ? t1 : classType;
+    int column = t2 < classType ? t2 : classType;
+    return (compatibility[row] >> column) & 1;
+}
+
+
+/* An object stored as another type, even an array entry, could have its fields read
+ * by index later on, and an array stored as an object could have been filled in by
+ * index. Arithmetic on objects is already an error unless the left operand is an
+ * Array, which is not followed. */
+void Parser::CheckAliasing(shard &s, TypeId target, TypeId value) {
+    if (target == value || value == nullType)
+        return;
+    if (value >= classType)
+        s.aliasedTypes.push_back(value);
+    if (target >= classType)
+        s.aliasedTypes.push_back(target);
 }
 
 
@@ -307,96 +422,471 @@ void Parser::Warning(Token t, std::string message) {
 }
 
 
-void Parser::ResolveError(Parser::declaration d, std::string message) {
-    std::cout << d.filename << ".jack: Error, line " << d.lineNum << ", "
-              << message << std::endl;
-    exit(0);
+void Parser::ResolveError(shard &s, const declaration &d, const std::string &message) {
+    diagnostic diag = {d.filename, d.lineNum, s.list, s.position, true, message};
+    s.diagnostics.push_back(diag);
 }
 
 
-void Parser::ResolveWarning(Parser::declaration d, std::string message) {
-    std::cout << d.filename << ".jack: Warning, line " << d.lineNum << ", "
-              << message << std::endl;
+void Parser::ResolveWarning(shard &s, const declaration &d, const std::string &message) {
+    diagnostic diag = {d.filename, d.lineNum, s.list, s.position, false, message};
+    s.diagnostics.push_back(diag);
 }
 
 
-void Parser::WriteCode(std::string vmCode) {
-    unsigned long currentFile = vmFiles.size() - 1;
-    vmFiles[currentFile].vmCode.push_back(vmCode);
+/* Print the diagnostics of all shards by file then line, the same regardless of
+ * the number of shards. Stop the compilation if there was an error. */
+void Parser::ReportDiagnostics(std::vector<shard> &shards) {
+    std::vector <diagnostic> all;
+    for (shard &s: shards)
+        all.insert(all.end(), s.diagnostics.begin(), s.diagnostics.end());
+    std::stable_sort(all.begin(), all.end(), [](const diagnostic &a, const diagnostic &b) {
+        if (a.filename != b.filename)
+            return a.filename < b.filename;
+        if (a.lineNum != b.lineNum)
+            return a.lineNum < b.lineNum;
+        if (a.list != b.list)
+            return a.list < b.list;
+        return a.position < b.position;
+    });
+
+    bool foundError = false;
+    for (const diagnostic &d: all) {
+        std::cout << d.filename << ".jack: " << (d.error ? "Error" : "Warning") << ", line "
+                  << d.lineNum << ", " << d.message << std::endl;
+        foundError = foundError || d.error;
+    }
+    if (foundError)
+        exit(0);
+}
+
+
+void Parser::WriteCode(VmInstruction::opcode op, VmInstruction::segmentName segment, int index) {
+    VmInstruction i = {op, segment, 0, index};
+    vmFiles.back().vmCode.push_back(i);
+}
+
+
+// Instructions without a segment, the operand is a label number or a name id
+void Parser::WriteCode(VmInstruction::opcode op, int operand) {
+    WriteCode(op, VmInstruction::constant, operand);
+}
+
+
+void Parser::WriteCall(const std::string &function, int nArgs) {
+    VmInstruction i = {VmInstruction::call, VmInstruction::constant,
+                       (unsigned short)nArgs, InternName(function)};
+    vmFiles.back().vmCode.push_back(i);
+}
+
+
+// Function names are kept once however many instructions refer to them
+int Parser::InternName(const std::string &name) {
+    std::unordered_map<std::string, int>::iterator it = vmNameIds.find(name);
+    if (it != vmNameIds.end())
+        return it->second;
+    vmNames.push_back(name);
+    vmNameIds[name] = vmNames.size() - 1;
+    return vmNames.size() - 1;
+}
+
+
+// Append the digits of a number straight into the buffer, no temporary strings
+static void AppendNumber(std::string &buffer, long number) {
+    char digits[24];
+    int n = 0;
+    bool negative = number < 0;
+    unsigned long value = negative ? -(unsigned long)number : number;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    if (negative)
+        buffer += '-';
+    while (n > 0)
+        buffer += digits[--n];
+}
+
+
+// Append the VM text of an instruction and its newline to the buffer
+void Parser::AppendInstruction(std::string &buffer, const VmInstruction &i) {
+    static const char *opcodes[] = {"push ", "pop ", "add", "sub", "neg", "eq", "gt", "lt",
+                                    "and", "or", "not", "label l", "goto l", "if-goto l",
+                                    "function ", "call ", "return", ""};
+    static const char *segments[] = {"constant ", "argument ", "local ", "static ", "this ",
+                                     "that ", "pointer ", "temp "};
+    buffer += opcodes[i.op];
+    switch (i.op) {
+        case VmInstruction::push:
+        case VmInstruction::pop:
+            buffer += segments[i.segment];
+            AppendNumber(buffer, i.operand);
+            break;
+        case VmInstruction::label:
+        case VmInstruction::GOTO:
+        case VmInstruction::ifGoto:
+            AppendNumber(buffer, i.operand);
+            break;
+        case VmInstruction::function:
+        case VmInstruction::call:
+            buffer += vmNames[i.operand];
+            buffer += ' ';
+            AppendNumber(buffer, i.count);
+            break;
+        case VmInstruction::callee:
+            buffer += vmNames[i.operand];
+            break;
+        default:
+            break;
+    }
+    buffer += '\n';
+}
+
+
+// Write all of the content, write may take less than asked for on a pipe
+static void WriteAll(int fd, const std::string &content) {
+    unsigned long done = 0;
+    ssize_t n = 1;
+    while (done < content.size() && (n = write(fd, content.data() + done, content.size() - done)) > 0)
+        done += n;
+}
+
+
+/* Write the content to a file with a single write call, unless the file already
+ * has exactly that content, so its modification time only changes with it */
+static void WriteIfChanged(const std::string &filename, const std::string &content) {
+    struct stat status;
+    if (stat(filename.c_str(), &status) == 0 && (unsigned long)status.st_size == content.size()) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            std::string existing(content.size(), '\0');
+            unsigned long done = 0;
+            ssize_t n = 1;
+            while (done < existing.size() && (n = read(fd, &existing[done], existing.size() - done)) > 0)
+                done += n;
+            close(fd);
+            if (done == content.size() && existing == content)
+                return;
+        }
+    }
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cout << "Couldn't write " << filename << std::endl;
+        return;
+    }
+    WriteAll(fd, content);
+    close(fd);
 }
 
 
 /* When writing code for 'do sub', extra 'pop temp 0' statements are inserted for
- * void functions, if the function isnt void remove the pop statement. */
-void Parser::RemovePopCode(Symbol s) {
-    for (unsigned int i=0; i < vmFiles.size(); i++) {
-        for (unsigned int j=0; j < vmFiles[i].vmCode.size(); j++) {
-            if (vmFiles[i].vmCode[j] == s.name && s.type == "void")
-                vmFiles[i].vmCode.erase(vmFiles[i].vmCode.begin()+j);
-            else if (vmFiles[i].vmCode[j] == s.name && s.type != "void") {
-                vmFiles[i].vmCode.erase(vmFiles[i].vmCode.begin()+j);
-                vmFiles[i].vmCode.erase(vmFiles[i].vmCode.begin()+j);
+ * void functions, if the function isnt void remove the pop statement. Each file is
+ * compacted in place, the markers are always removed. */
+void Parser::RemovePopCode() {
+    for (VmFile &f: vmFiles) {
+        unsigned long n = 0;
+        for (unsigned long j=0; j < f.vmCode.size(); j++) {
+            if (f.vmCode[j].op != VmInstruction::callee)
+                f.vmCode[n++] = f.vmCode[j];
+            else {
+                SymbolIndex::const_iterator it = members.find(vmNames[f.vmCode[j].operand]);
+                if (it != members.end() && it->second->type != "void")
+                    j++; // Skip the marker and the pop statement after it
             }
         }
+        f.vmCode.resize(n);
     }
 }
 
 
-// Write the VM code for each file to a file
+/* Rewrite the VM code of every file once the program has been checked, the whole
+ * program passes assume no other code calls into the program */
+void Parser::Optimise(Optimiser &optimiser, bool wholeProgram) {
+    for (VmFile &f: vmFiles) {
+        optimiser.LoopTailCalls(f.vmCode, subroutineParameters);
+        optimiser.Peephole(f.vmCode);
+        optimiser.EliminateCommonSubexpressions(f.vmCode);
+        optimiser.HoistLoopInvariants(f.vmCode);
+        optimiser.ReduceInductionVariables(f.vmCode);
+        optimiser.ReduceMultiplications(f.vmCode);
+        optimiser.ThreadJumps(f.vmCode);
+        optimiser.Peephole(f.vmCode);
+        optimiser.TrackPointers(f.vmCode);
+        optimiser.CoalesceLocals(f.vmCode);
+    }
+
+    // Only if every class of the program is in vmFiles, nothing else can call them
+    if (wholeProgram) {
+        std::vector <Optimiser::Code*> files;
+        for (VmFile &f: vmFiles)
+            files.push_back(&f.vmCode);
+        for (VmFile &f: vmFiles) {
+            std::unordered_map<std::string, TypeId>::const_iterator it = typeIds.find(f.filename);
+            if (it != typeIds.end() && !aliasedTypes.count(it->second))
+                optimiser.RemoveUnusedFields(f.vmCode);
+        }
+        optimiser.InlineCalls(files);
+        for (VmFile &f: vmFiles) {
+            optimiser.Peephole(f.vmCode);
+            optimiser.TrackPointers(f.vmCode);
+            optimiser.CoalesceLocals(f.vmCode);
+        }
+        std::vector <int> roots = {InternName("Main.main"), InternName("Sys.init")};
+        optimiser.RemoveDeadFunctions(files, roots);
+    }
+}
+
+
+/* Write the VM code for each file to a file, each one is formatted into a single
+ * buffer first, reused from one file to the next. */
 void Parser::WriteVmFiles(std::string path) {
-    for (VmFile f: vmFiles) {
-        std::ofstream file(path + '/' + f.filename + ".vm");
-        for (std::string code: f.vmCode)
-            file << code << std::endl;
-        file.close();
+    std::string buffer;
+    for (const VmFile &f: vmFiles) {
+        buffer.clear();
+        buffer.reserve(f.vmCode.size() * 24);
+        for (const VmInstruction &i: f.vmCode)
+            AppendInstruction(buffer, i);
+        WriteIfChanged(path + '/' + f.filename + ".vm", buffer);
     }
 }
 
 
-// Used for creating labels for code generation
-std::string Parser::CreateLabel() {
-    return "l" + std::to_string(labelCounter++);
+/* Write the whole program as one stream instead, the code of each file after a
+ * '// file: X.vm' line. The filename '-' writes it to stdout. */
+void Parser::WriteBundle(std::string filename) {
+    std::string buffer;
+    for (const VmFile &f: vmFiles) {
+        buffer += "// file: ";
+        buffer += f.filename;
+        buffer += ".vm\n";
+        for (const VmInstruction &i: f.vmCode)
+            AppendInstruction(buffer, i);
+    }
+    if (filename == "-")
+        WriteAll(1, buffer);
+    else
+        WriteIfChanged(filename, buffer);
 }
 
 
-/* Gets passed the 'identifier.identifier()'. Second identifier might not exist i.e.
- * 'do something()'. The if statements are based on how I store them. */
-std::string Parser::GetNumOfArgs(std::string name, std::string type) {
-    unsigned int size = 0;
-    std::vector <std::string> functionArgs;
-    for (declaration d: subroutineCalls) {
-        if (d.name == "new") {
-            if (d.type == name) {
-                size = d.arguments.size();
-                functionArgs = d.arguments;
-            }
-        }
-        else if (d.name == name && type.empty()) {
-            size = d.arguments.size();
-            functionArgs = d.arguments;
+// Compile one source file of the program, returns the name of the class it declares
+std::string Parser::CompileClass(std::string filename, std::string filePath) {
+    // Create VmFile object and add it to the list
+    VmFile file;
+    file.filename = filename;
+    vmFiles.push_back(file);
+
+    bool init = Init(filePath);
+    if (init) {
+        ClassDeclar();
+        return currentClass;
+    }
+    return "";
+}
+
+
+/* Used instead of compiling a class that is up to date, its entries are added to
+ * the program SymbolTable as they were when it was compiled. */
+void Parser::RestoreClass(std::string filename, std::string filePath, std::string className,
+                          const std::vector<Symbol> &symbols,
+                          const std::set<std::string> &dependencies,
+                          const std::set<std::string> &calledNames) {
+    std::vector <Symbol> &table = symbolTables[0].table;
+    classSymbolRanges[className].first = table.size();
+    table.insert(table.end(), symbols.begin(), symbols.end());
+    classSymbolRanges[className].second = table.size();
+    // Statics are numbered across the program, keep counting as if it was compiled
+    for (const Symbol &s: symbols) {
+        if (s.kind == Symbol::STATIC)
+            symbolTables[0].staticCounter = s.offset + 1;
+    }
+
+    classSources[className] = filePath;
+    classOutputs[className] = filename;
+    classDependencies[className] = dependencies;
+    classCalledNames[className] = calledNames;
+}
+
+
+/* Compile a restored class again, its entries are replaced in the program SymbolTable
+ * at the same position so the symbols are found in the same order as before. */
+void Parser::RecompileClass(std::string filename, std::string filePath, std::string className) {
+    std::vector <Symbol> &table = symbolTables[0].table;
+    std::pair <unsigned long, unsigned long> range = classSymbolRanges[className];
+    // Number its statics from where they were numbered before
+    int staticCounter = symbolTables[0].staticCounter;
+    for (unsigned long i = range.first; i < range.second; i++) {
+        if (table[i].kind == Symbol::STATIC) {
+            symbolTables[0].staticCounter = table[i].offset;
+            break;
         }
-        else if (d.name == type && !name.empty()) {
-            size = d.arguments.size();
-            functionArgs = d.arguments;
+    }
+    table.erase(table.begin() + range.first, table.begin() + range.second);
+    classDependencies.erase(className);
+    classCalledNames.erase(className);
+
+    CompileClass(filename, filePath);
+    symbolTables[0].staticCounter = staticCounter;
+    unsigned long nSymbols = range.second - range.first;
+    std::rotate(table.begin() + range.first, table.end() - nSymbols, table.end());
+    classSymbolRanges[className] = range;
+}
+
+
+std::vector <Symbol> Parser::ClassSymbols(std::string className) {
+    std::pair <unsigned long, unsigned long> range = classSymbolRanges[className];
+    return std::vector<Symbol>(symbolTables[0].table.begin() + range.first,
+                               symbolTables[0].table.begin() + range.second);
+}
+
+
+std::set <std::string> Parser::ClassDependencies(std::string className) {
+    return classDependencies[className];
+}
+
+
+std::set <std::string> Parser::ClassCalledNames(std::string className) {
+    return classCalledNames[className];
+}
+
+
+/* The type calls to a name resolve to, the first subroutine, field or static with
+ * that name, the same rule ResolveAllDeclars uses */
+std::unordered_map <std::string, std::string> Parser::MemberTypes() {
+    std::unordered_map <std::string, std::string> types;
+    for (const Symbol &s: symbolTables[0].table) {
+        if (s.kind == Symbol::subroutine || s.kind == Symbol::field ||
+            s.kind == Symbol::STATIC)
+            types.insert({s.name, s.type});
+    }
+    return types;
+}
+
+
+// Record that the class being parsed references another class
+void Parser::AddDependency(const std::string &className) {
+    if (className != currentClass)
+        classDependencies[currentClass].insert(className);
+}
+
+
+// Make depfile syntax needs spaces, '#' and '$' escaped in paths
+static std::string EscapeMakePath(const std::string &path) {
+    std::string escaped;
+    for (char c: path) {
+        if (c == ' ' || c == '#')
+            escaped += '\\';
+        else if (c == '$')
+            escaped += '$';
+        escaped += c;
+    }
+    return escaped;
+}
+
+
+static std::string EscapeJson(const std::string &text) {
+    std::string escaped;
+    for (char c: text) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+
+/* Write a Make/Ninja depfile, every VM file depends on its own source and on the
+ * sources of the classes it references. */
+void Parser::WriteDepFile(std::string filename, std::string path) {
+    std::ofstream file(filename);
+    for (const std::pair<const std::string, std::string> &c: classOutputs) {
+        file << EscapeMakePath(path + '/' + c.second + ".vm") << ": "
+             << EscapeMakePath(classSources[c.first]);
+        for (const std::string &dependency: classDependencies[c.first]) {
+            if (classSources.count(dependency))
+                file << " \\\n  " << EscapeMakePath(classSources[dependency]);
         }
+        file << "\n";
     }
+}
+
 
-    /* Because the expressions havent been evaluated yet for semantics so just
-     * find the size without removing anything */
-    for (std::string s: functionArgs) {
-        if (s == "*" || s == "/" || s == "+" || s == "-" ||
-            s == "<" || s == ">" || s == "=") {
-            size = size - 2;
+// Write the class dependency graph as JSON, for the program classes only
+void Parser::WriteDependencyJson(std::string filename, std::string path) {
+    std::ofstream file(filename);
+    file << "{\n  \"classes\": {";
+    bool first = true;
+    for (const std::pair<const std::string, std::string> &c: classOutputs) {
+        file << (first ? "\n" : ",\n") << "    \"" << EscapeJson(c.first) << "\": {\n"
+             << "      \"source\": \"" << EscapeJson(classSources[c.first]) << "\",\n"
+             << "      \"output\": \"" << EscapeJson(path + '/' + c.second + ".vm") << "\",\n"
+             << "      \"dependencies\": [";
+        bool firstDependency = true;
+        for (const std::string &dependency: classDependencies[c.first]) {
+            if (classSources.count(dependency)) {
+                file << (firstDependency ? "" : ", ") << "\"" << EscapeJson(dependency) << "\"";
+                firstDependency = false;
+            }
         }
-        else if (s == "ArrayEntry") // Because ArrayEntry has index but its only 1 thing
-            size = size - 1;
+        file << "]\n    }";
+        first = false;
     }
-    return std::to_string(size);
+    file << "\n  }\n}\n";
+}
+
+
+// Used for creating labels for code generation, label n is written as 'ln'
+int Parser::CreateLabel() {
+    return labelCounter++;
+}
+
+
+// Code building a new String with the characters of a literal
+void Parser::WriteString(const std::string &literal) {
+    WriteCode(VmInstruction::push, VmInstruction::constant, literal.length());
+    WriteCall("String.new", 1);
+    for (char c: literal) {
+        WriteCode(VmInstruction::push, VmInstruction::constant, int(c));
+        WriteCall("String.appendChar", 2);
+    }
+}
+
+
+/* Returns the hidden static holding a string literal of the class, the same literal
+ * used twice in a class shares a static */
+int Parser::PoolLiteral(const std::string &literal) {
+    std::unordered_map<std::string, int>::iterator it = classLiteralStatics.find(literal);
+    if (it != classLiteralStatics.end())
+        return it->second;
+    int offset = symbolTables[1].staticCounter++; // Class table, not a symbol
+    classLiteralStatics[literal] = offset;
+    classLiterals.push_back({literal, offset});
+    return offset;
+}
+
+
+/* The hidden function '<class>.$strings' building every pooled literal of the class,
+ * called once by the guard at the start of the subroutines that use them */
+void Parser::WriteLiteralPool() {
+    if (classLiterals.empty())
+        return;
+    WriteCall(currentClass + ".$strings", 0);
+    vmFiles.back().vmCode.back().op = VmInstruction::function;
+    // Build the first literal last as its static is the guard
+    for (unsigned long i = classLiterals.size(); i > 0; i--) {
+        WriteString(classLiterals[i-1].first);
+        WriteCode(VmInstruction::pop, VmInstruction::STATIC, classLiterals[i-1].second);
+    }
+    WriteCode(VmInstruction::push, VmInstruction::constant, 0);
+    WriteCode(VmInstruction::RETURN);
 }
 
 
 void Parser::ClassDeclar() {
     labelCounter = 0; // reset labels just for convience of reading the code
+    classLiterals.clear();
+    classLiteralStatics.clear();
     // Create and switch to the SymbolTable for the class scope
     SymbolTable newSymbolTable;
     symbolTables.push_back(newSymbolTable);
@@ -417,6 +907,12 @@ void Parser::ClassDeclar() {
             Error(t, "Redeclaration of identifier.");
         s.name = t.lexeme;
         symbolTables[currentSymbolTable-1].AddSymbol(s); // Program ST
+        classSymbolRanges[currentClass].first = symbolTables[0].table.size() - 1;
+
+        // For the dependency graph, JackOS files are parsed without an output
+        classSources[currentClass] = currentSourceFile;
+        if (!vmFiles.back().filename.empty())
+            classOutputs[currentClass] = vmFiles.back().filename;
     }
     else
         Error(t, "Expected an identifier.");
@@ -433,9 +929,11 @@ void Parser::ClassDeclar() {
         t = l.PeekNextToken();
     }
     l.GetNextToken();       // Consume the '}'
+    WriteLiteralPool();
 
     symbolTables.erase(symbolTables.begin() + 1);
     currentSymbolTable = 0; // Switch to the program Symbol Table
+    classSymbolRanges[currentClass].second = symbolTables[0].table.size();
     l.DeleteEOF();
 }
 
@@ -524,6 +1022,7 @@ void Parser::Type() {
         d.type = t.lexeme;
         d.lineNum = t.lineNum;
         varDeclarations.push_back(d);
+        AddDependency(t.lexeme);
     }
     else
         Error(t, "Unknown type.");
@@ -595,26 +1094,39 @@ void Parser::SubroutineDeclar() {
         Error(t, "Expected a ')'.");
 
     // Code Generation
-    WriteCode("function " + currentClass + "." + currentSubroutine + " ");
+    unsigned long currentFile = vmFiles.size() - 1;
+    unsigned long functionIndex = vmFiles[currentFile].vmCode.size();
+    WriteCall(currentClass + "." + currentSubroutine, 0);
+    vmFiles[currentFile].vmCode[functionIndex].op = VmInstruction::function;
     if (currentSubroutineKind == "constructor") {
         int nFields = symbolTables[currentSymbolTable-1].fieldsCounter;
-        std::string allocSize;
-        allocSize = std::to_string(nFields);
-        WriteCode("push constant " + allocSize);
-        WriteCode("call Memory.alloc 1");
-        WriteCode("pop pointer 0");
+        WriteCode(VmInstruction::push, VmInstruction::constant, nFields);
+        WriteCall("Memory.alloc", 1);
+        WriteCode(VmInstruction::pop, VmInstruction::pointer, 0);
     }
     else if (currentSubroutineKind == "method") {
-        WriteCode("push argument 0");
-        WriteCode("pop pointer 0");
+        WriteCode(VmInstruction::push, VmInstruction::argument, 0);
+        WriteCode(VmInstruction::pop, VmInstruction::pointer, 0);
     }
+    subroutineUsesLiterals = false;
     SubroutineBody();
     // Add the number of locals to the statement
-    std::string nVars = std::to_string(symbolTables[currentSymbolTable].localsCounter);
-    unsigned long currentFile = vmFiles.size() - 1;
-    for (std::string &code: vmFiles[currentFile].vmCode) {
-        if (code == "function " + currentClass + "." + currentSubroutine + " ")
-            code += nVars;
+    vmFiles[currentFile].vmCode[functionIndex].count = symbolTables[currentSymbolTable].localsCounter;
+    subroutineParameters[vmFiles[currentFile].vmCode[functionIndex].operand] =
+            symbolTables[currentSymbolTable].argumentsCounter;
+
+    /* Pooled string literals are built the first time a subroutine using them runs,
+     * the first pooled static is only 0 until then */
+    if (subroutineUsesLiterals) {
+        int ready = CreateLabel();
+        VmInstruction guard[] = {
+            {VmInstruction::push, VmInstruction::STATIC, 0, classLiterals[0].second},
+            {VmInstruction::ifGoto, VmInstruction::constant, 0, ready},
+            {VmInstruction::call, VmInstruction::constant, 0, InternName(currentClass + ".$strings")},
+            {VmInstruction::pop, VmInstruction::temp, 0, 0},
+            {VmInstruction::label, VmInstruction::constant, 0, ready}};
+        std::vector <VmInstruction> &code = vmFiles[currentFile].vmCode;
+        code.insert(code.begin() + functionIndex + 1, guard, guard + 5);
     }
 
     symbolTables.erase(symbolTables.begin() + 2); // Delete method table
@@ -678,6 +1190,8 @@ void Parser::SubroutineBody() {
     else
         Error(t, "Expected a '{'.");
 
+    flow.Reset();
+
     // Semantic check - all code paths must return a value
     bool foundReturn = false;
     foundIfReturn = false;
@@ -695,12 +1209,32 @@ void Parser::SubroutineBody() {
     // Void functions dont have to have a return so flag it as true
     if (currentSubroutineType == "void" && !foundReturn) {
         foundReturn = true;
-        WriteCode("push constant 0");
-        WriteCode("return");
+        WriteCode(VmInstruction::push, VmInstruction::constant, 0);
+        WriteCode(VmInstruction::RETURN);
     }
 
     if (!foundReturn && !(foundIfReturn && foundElseReturn))
         Error(t, "Not all code paths return a value in subroutine '" + currentSubroutine + "'.");
+
+    // Semantic check - locals must be assigned on every path before being read
+    int nLocals = symbolTables[currentSymbolTable].localsCounter;
+    for (Token read: flow.UnassignedReads(nLocals))
+        Warning(read, "Variable not initialised before being used.");
+    for (Token write: flow.DeadWrites(nLocals))
+        Warning(write, "Value assigned to variable is never used.");
+}
+
+
+// Record a read or write of a local variable in the flow graph of the subroutine
+void Parser::FlowAccess(Token t, bool write) {
+    SymbolTable &table = symbolTables[currentSymbolTable];
+    if (table.FindSymbol(t.lexeme) && table.GetSymbolKind(t.lexeme) == Symbol::var) {
+        int variable = std::stoi(table.GetSymbolOffset(t.lexeme));
+        if (write)
+            flow.Write(variable, t);
+        else
+            flow.Read(variable, t);
+    }
 }
 
 
@@ -774,7 +1308,6 @@ void Parser::VarDeclarStatement() {
 
 
 void Parser::LetStatement() {
-    expression.clear(); // empty the vector used to store expressions to avoid
     Token t = l.GetNextToken();
     unsigned int index = vmFiles.size() - 1;
     declaration d;
@@ -787,6 +1320,7 @@ void Parser::LetStatement() {
 
     t = l.GetNextToken();
     std::string assignedTo;
+    Token assignedToken = t;
     if (t.type == t.identifier) {
         assignedTo = t.lexeme;
         // Variable must be declared before being used
@@ -798,11 +1332,11 @@ void Parser::LetStatement() {
         // Find and set the variable as initialised and get type for comparison with RHS
         if (symbolTables[currentSymbolTable].FindSymbol(t.lexeme)) { // Method table
             symbolTables[currentSymbolTable].SetInitialised(t.lexeme);
-            d.LHS = symbolTables[currentSymbolTable].GetSymbolType(t.lexeme);
+            d.LHS = InternType(symbolTables[currentSymbolTable].GetSymbolType(t.lexeme));
         }
         else if (symbolTables[currentSymbolTable-1].FindSymbol(t.lexeme)) { // Class table
             symbolTables[currentSymbolTable-1].SetInitialised(t.lexeme);
-            d.LHS = symbolTables[currentSymbolTable-1].GetSymbolType(t.lexeme);
+            d.LHS = InternType(symbolTables[currentSymbolTable-1].GetSymbolType(t.lexeme));
         }
     }
     else
@@ -812,49 +1346,50 @@ void Parser::LetStatement() {
     t = l.PeekNextToken();
     if (t.lexeme == "[") {
         isArrayEntry = true;
-        d.LHS = "ArrayEntry";
+        d.LHS = arrayEntryType;
         l.GetNextToken();    // Consume the '['
 
         // Code Generation
         if (symbolTables[currentSymbolTable].FindSymbol(assignedTo)) { // Method table
-            std::string offset = symbolTables[currentSymbolTable].GetSymbolOffset(assignedTo);
+            int offset = std::stoi(symbolTables[currentSymbolTable].GetSymbolOffset(assignedTo));
             Symbol::symbolKind k;
             k = symbolTables[currentSymbolTable].GetSymbolKind(assignedTo);
             if (k == 0)
-                WriteCode("push static " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::STATIC, offset);
             else if (k == 1)
-                WriteCode("push this " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::THIS, offset);
             else if (k == 2)
-                WriteCode("push argument " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::argument, offset);
             else if (k == 3)
-                WriteCode("push local " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::local, offset);
+            FlowAccess(assignedToken, false);
         }
         else if (symbolTables[currentSymbolTable-1].FindSymbol(assignedTo)) { // Class table
-            std::string offset = symbolTables[currentSymbolTable-1].GetSymbolOffset(assignedTo);
+            int offset = std::stoi(symbolTables[currentSymbolTable-1].GetSymbolOffset(assignedTo));
             Symbol::symbolKind k;
             k = symbolTables[currentSymbolTable-1].GetSymbolKind(assignedTo);
             if (k == 0)
-                WriteCode("push static " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::STATIC, offset);
             else if (k == 1)
-                WriteCode("push this " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::THIS, offset);
             else if (k == 2)
-                WriteCode("push argument " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::argument, offset);
             else if (k == 3)
-                WriteCode("pop local " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::local, offset);
         }
 
         // Semantic Check - Array index expression must evaluate to 'int'
         declaration d2;
         d2.filename = vmFiles[index].filename;
         d2.lineNum = t.lineNum;
+        unsigned long mark = operations.size();
         Expression();
-        d2.arguments = expression;
+        d2.exprType = PopExpression(d2, mark);
         arrayIndices.push_back(d2);
-        expression.clear();
 
         t = l.GetNextToken();
         if (t.lexeme == "]")
-            WriteCode("add");
+            WriteCode(VmInstruction::add);
         else
             Error(t, "Expected a ']'.");
     }
@@ -865,18 +1400,18 @@ void Parser::LetStatement() {
     else
         Error(t, "Expected a '='.");
 
+    unsigned long mark = operations.size();
     Expression();
-    // Store the RHS expressions and add them to the list to resolve at the end
-    d.arguments = expression;
+    // Store the RHS expression type and add it to the list to resolve at the end
+    d.exprType = PopExpression(d, mark);
     assignments.push_back(d);
-    expression.clear();
 
     // If it is assigning to an ArrayEntry write code for the array access
     if (isArrayEntry) {
-        WriteCode("pop temp 0");
-        WriteCode("pop pointer 1");
-        WriteCode("push temp 0");
-        WriteCode("pop that 0");
+        WriteCode(VmInstruction::pop, VmInstruction::temp, 0);
+        WriteCode(VmInstruction::pop, VmInstruction::pointer, 1);
+        WriteCode(VmInstruction::push, VmInstruction::temp, 0);
+        WriteCode(VmInstruction::pop, VmInstruction::that, 0);
     }
 
     t = l.GetNextToken();
@@ -888,30 +1423,31 @@ void Parser::LetStatement() {
     // ArrayEntry code already generated above, if it is not an ArrayEntry generate code
     if (!isArrayEntry) {
         if (symbolTables[currentSymbolTable].FindSymbol(assignedTo)) { // Method table
-            std::string offset = symbolTables[currentSymbolTable].GetSymbolOffset(assignedTo);
+            int offset = std::stoi(symbolTables[currentSymbolTable].GetSymbolOffset(assignedTo));
             Symbol::symbolKind k;
             k = symbolTables[currentSymbolTable].GetSymbolKind(assignedTo);
             if (k == 0)
-                WriteCode("pop static " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::STATIC, offset);
             else if (k == 1)
-                WriteCode("pop this " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::THIS, offset);
             else if (k == 2)
-                WriteCode("pop argument " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::argument, offset);
             else if (k == 3)
-                WriteCode("pop local " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::local, offset);
+            FlowAccess(assignedToken, true);
         }
         else if (symbolTables[currentSymbolTable-1].FindSymbol(assignedTo)) { // Class table
-            std::string offset = symbolTables[currentSymbolTable-1].GetSymbolOffset(assignedTo);
+            int offset = std::stoi(symbolTables[currentSymbolTable-1].GetSymbolOffset(assignedTo));
             Symbol::symbolKind k;
             k = symbolTables[currentSymbolTable-1].GetSymbolKind(assignedTo);
             if (k == 0)
-                WriteCode("pop static " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::STATIC, offset);
             else if (k == 1)
-                WriteCode("pop this " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::THIS, offset);
             else if (k == 2)
-                WriteCode("pop argument " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::argument, offset);
             else if (k == 3)
-                WriteCode("pop local " + offset);
+                WriteCode(VmInstruction::pop, VmInstruction::local, offset);
         }
     }
 }
@@ -919,7 +1455,7 @@ void Parser::LetStatement() {
 
 void Parser::IfStatement() {
     // Code Generation - labels
-    std::string l1, l2;
+    int l1, l2;
     Token t = l.GetNextToken();
     if (t.lexeme == "if")
         ;
@@ -937,12 +1473,17 @@ void Parser::IfStatement() {
     t = l.GetNextToken();
     if (t.lexeme == ")") {
         l1 = CreateLabel();
-        WriteCode("not");
-        WriteCode("if-goto " + l1);
+        WriteCode(VmInstruction::NOT);
+        WriteCode(VmInstruction::ifGoto, l1);
     }
     else
         Error(t, "Expected a ')'.");
 
+    // Flow graph - the condition block branches to the if block and to the else or end
+    int conditionBlock = flow.current;
+    flow.current = flow.NewBlock();
+    flow.AddEdge(conditionBlock, flow.current);
+
     t = l.GetNextToken();
     if (t.lexeme == "{")
         ;
@@ -960,12 +1501,16 @@ void Parser::IfStatement() {
 
     // Code Generation
     l2 = CreateLabel();
-    WriteCode("goto " + l2);
-    WriteCode("label " + l1);
+    WriteCode(VmInstruction::GOTO, l2);
+    WriteCode(VmInstruction::label, l1);
+    int ifEndBlock = flow.current;
+    int elseEndBlock = conditionBlock;
 
     t = l.PeekNextToken();
     if (t.lexeme == "else") {
         l.GetNextToken();    // Consume the 'else'
+        flow.current = flow.NewBlock();
+        flow.AddEdge(conditionBlock, flow.current);
 
         t = l.GetNextToken();
         if (t.lexeme == "{")
@@ -981,24 +1526,35 @@ void Parser::IfStatement() {
             t = l.PeekNextToken();
         }
         l.GetNextToken();       // Consume the '}'
+        elseEndBlock = flow.current;
     }
     // Code Generation
-    WriteCode("label " + l2);
+    WriteCode(VmInstruction::label, l2);
+
+    // Flow graph - both paths join after the if statement
+    flow.current = flow.NewBlock();
+    flow.AddEdge(ifEndBlock, flow.current);
+    flow.AddEdge(elseEndBlock, flow.current);
 }
 
 
 void Parser::WhileStatement() {
     // Code Generation - labels
-    std::string l1, l2;
+    int l1, l2;
 
     Token t = l.GetNextToken();
     if (t.lexeme == "while") {
         l1 = CreateLabel();
-        WriteCode("label " + l1);
+        WriteCode(VmInstruction::label, l1);
     }
     else
         Error(t, "Expected keyword 'while'.");
 
+    // Flow graph - the condition gets its own block as the loop jumps back to it
+    int conditionBlock = flow.NewBlock();
+    flow.AddEdge(flow.current, conditionBlock);
+    flow.current = conditionBlock;
+
     t = l.GetNextToken();
     if (t.lexeme == "(")
         ;
@@ -1011,12 +1567,15 @@ void Parser::WhileStatement() {
     if (t.lexeme == ")") {
         // Code Generation - Check loop
         l2 = CreateLabel();
-        WriteCode("not");
-        WriteCode("if-goto " + l2);
+        WriteCode(VmInstruction::NOT);
+        WriteCode(VmInstruction::ifGoto, l2);
     }
     else
         Error(t, "Expected a ')'.");
 
+    flow.current = flow.NewBlock();
+    flow.AddEdge(conditionBlock, flow.current);
+
     t = l.GetNextToken();
     if (t.lexeme == "{")
         ;
@@ -1031,8 +1590,13 @@ void Parser::WhileStatement() {
     l.GetNextToken();       // Consume the '}'
 
     // Code Generation
-    WriteCode("goto " + l1);
-    WriteCode("label " + l2);
+    WriteCode(VmInstruction::GOTO, l1);
+    WriteCode(VmInstruction::label, l2);
+
+    // Flow graph - the loop body goes back to the condition, which exits the loop
+    flow.AddEdge(flow.current, conditionBlock);
+    flow.current = flow.NewBlock();
+    flow.AddEdge(conditionBlock, flow.current);
 }
 
 
@@ -1062,30 +1626,31 @@ void Parser::SubroutineCall() {
 
         // Code Generation
         if (symbolTables[currentSymbolTable].FindSymbol(t.lexeme)) { // method table
-            std::string offset = symbolTables[currentSymbolTable].GetSymbolOffset(t.lexeme);
+            int offset = std::stoi(symbolTables[currentSymbolTable].GetSymbolOffset(t.lexeme));
             Symbol::symbolKind k;
             k = symbolTables[currentSymbolTable].GetSymbolKind(t.lexeme);
             if (k == 0) // static variables
-                WriteCode("push static " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::STATIC, offset);
             else if (k == 1) // field variables
-                WriteCode("push this " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::THIS, offset);
             else if (k == 2) // argument variables
-                WriteCode("push argument " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::argument, offset);
             else if (k == 3) // local variables
-                WriteCode("push local " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::local, offset);
+            FlowAccess(t, false);
         }
         else if (symbolTables[currentSymbolTable-1].FindSymbol(t.lexeme)) { // Class table
-            std::string offset = symbolTables[currentSymbolTable-1].GetSymbolOffset(t.lexeme);
+            int offset = std::stoi(symbolTables[currentSymbolTable-1].GetSymbolOffset(t.lexeme));
             Symbol::symbolKind k;
             k = symbolTables[currentSymbolTable-1].GetSymbolKind(t.lexeme);
             if (k == 0) // static variables
-                WriteCode("push static " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::STATIC, offset);
             else if (k == 1) // field variables
-                WriteCode("push this " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::THIS, offset);
             else if (k == 2) // argument variables
-                WriteCode("push argument " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::argument, offset);
             else if (k == 3) // local variables
-                WriteCode("push local " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::local, offset);
         }
     }
     else
@@ -1112,7 +1677,8 @@ void Parser::SubroutineCall() {
 
     // Add it to the list for resolving at the end
     subroutineCalls.push_back(d);
-    ExpressionList();
+    classCalledNames[currentClass].insert(d.name);
+    int nArgs = ExpressionList();
 
     t = l.GetNextToken();
     if (t.lexeme == ")")
@@ -1126,10 +1692,7 @@ void Parser::SubroutineCall() {
     else
         Error(t, "Expected a ';'.");
 
-    // Code Generation
-    std::string numOfArgs = GetNumOfArgs(identifier1, identifier2);
-    int methodArgs = std::stoi(numOfArgs) + 1;
-    std::string methodNumOfArgs = std::to_string(methodArgs);
+    // Code Generation - methods get the object as an extra argument, nArgs + 1
 
     // Find the class the symbol belongs to and get it
     std::string type;
@@ -1139,34 +1702,40 @@ void Parser::SubroutineCall() {
         type = symbolTables[currentSymbolTable-1].GetSymbolType(identifier1);
 
     if (identifier2.empty()) {
-        WriteCode("push pointer 0");
-        WriteCode("call " + currentClass + "." + identifier1 + " " + methodNumOfArgs);
-        WriteCode(identifier1); // For the RemovePopCode() function
+        WriteCode(VmInstruction::push, VmInstruction::pointer, 0);
+        WriteCall(currentClass + "." + identifier1, nArgs + 1);
+        WriteCode(VmInstruction::callee, InternName(identifier1)); // For RemovePopCode()
     }
     else if (type.empty()) {
-        WriteCode("call " + identifier1 + "." + identifier2 + " " + numOfArgs);
-        WriteCode(identifier2);
+        AddDependency(identifier1); // Function of another class
+        WriteCall(identifier1 + "." + identifier2, nArgs);
+        WriteCode(VmInstruction::callee, InternName(identifier2));
     }
     else {
-        WriteCode("call " + type + "." + identifier2 + " " + methodNumOfArgs);
-        WriteCode(identifier2);
+        WriteCall(type + "." + identifier2, nArgs + 1);
+        WriteCode(VmInstruction::callee, InternName(identifier2));
     }
     /* If the called function was void then we get rid of the '0' left on top of the
      * stack. At the end of parsing if the function wasnt void this pop is removed */
-    WriteCode("pop temp 0");
+    WriteCode(VmInstruction::pop, VmInstruction::temp, 0);
 }
 
 
-void Parser::ExpressionList() {
+// Returns the number of expressions parsed, i.e. the number of arguments of the call
+int Parser::ExpressionList() {
+    int nExpressions = 0;
     Token t = l.PeekNextToken();
     if (t.lexeme == ")")
         ;
     else {
         // Semantic check - calls must have same number and type of arguments
         unsigned long methodIndex = subroutineCalls.size() - 1;
-        arguments.clear();
+        unsigned long mark = operations.size();
         Expression();
-        subroutineCalls[methodIndex].arguments = arguments;
+        // Nested calls may have been added, so only index the list after parsing
+        TypeId type = PopExpression(subroutineCalls[methodIndex], mark);
+        subroutineCalls[methodIndex].arguments.push_back(type);
+        nExpressions++;
 
         Token t = l.PeekNextToken();
         while (t.lexeme == ",") {
@@ -1174,11 +1743,14 @@ void Parser::ExpressionList() {
 
             Expression();
             // If there are more arguments
-            subroutineCalls[methodIndex].arguments = arguments;
+            type = PopExpression(subroutineCalls[methodIndex], mark);
+            subroutineCalls[methodIndex].arguments.push_back(type);
+            nExpressions++;
 
             t = l.PeekNextToken();
         }
     }
+    return nExpressions;
 }
 
 
@@ -1196,15 +1768,15 @@ void Parser::ReturnStatement() {
     d.lineNum = t.lineNum;
     d.name = currentSubroutine; // Store the subroutine name to which the return belongs
     d.type = currentSubroutineType;
-    expression.clear();
-
+    d.LHS = InternType(currentSubroutineType);
 
     bool thereIsExpression = false; // Flag for void returns
     t = l.PeekNextToken();
     if (t.lexeme != ";") {
+        unsigned long mark = operations.size();
         Expression();
         thereIsExpression = true;
-        d.arguments = expression;
+        d.exprType = PopExpression(d, mark);
     }
     returns.push_back(d);
 
@@ -1221,8 +1793,11 @@ void Parser::ReturnStatement() {
 
     // Code Generation
     if (currentSubroutineType == "void" && !thereIsExpression)
-        WriteCode("push constant 0");
-    WriteCode("return");
+        WriteCode(VmInstruction::push, VmInstruction::constant, 0);
+    WriteCode(VmInstruction::RETURN);
+
+    // Flow graph - nothing follows a return, so continue in a block with no way in
+    flow.current = flow.NewBlock();
 }
 
 
@@ -1233,12 +1808,13 @@ void Parser::Expression() {
     while (t.lexeme == "&" || t.lexeme == "|") {
         t = l.GetNextToken();    // Consume the '&' or '|'
         RelationalExpression();
+        typeStack.pop_back(); // Not type checked, keeps the left operand type
 
         // Code Generation
         if (t.lexeme == "&")
-            WriteCode("and");
+            WriteCode(VmInstruction::AND);
         else
-            WriteCode("or");
+            WriteCode(VmInstruction::OR);
 
         t = l.PeekNextToken();
     }
@@ -1250,20 +1826,17 @@ void Parser::RelationalExpression() {
 
     Token t = l.PeekNextToken();
     while (t.lexeme == "=" || t.lexeme == ">" || t.lexeme == "<") {
-        // Store expressions for semantic checks
-        expression.push_back(t.lexeme);
-        arguments.push_back(t.lexeme);
-
         t = l.GetNextToken();    // Consume the '=' or '>' or '<'
         ArithmeticExpression();
+        EvaluateOperator(t.lexeme); // Semantic check - operand types
 
         // Code Generation
         if (t.lexeme == "=")
-            WriteCode("eq");
+            WriteCode(VmInstruction::eq);
         else if (t.lexeme == ">")
-            WriteCode("gt");
+            WriteCode(VmInstruction::gt);
         else
-            WriteCode("lt");
+            WriteCode(VmInstruction::lt);
 
         t = l.PeekNextToken();
     }
@@ -1275,18 +1848,15 @@ void Parser::ArithmeticExpression() {
 
     Token t = l.PeekNextToken();
     while (t.lexeme == "+" || t.lexeme == "-") {
-        // Store expressions for semantic checks
-        expression.push_back(t.lexeme);
-        arguments.push_back(t.lexeme);
-
         t = l.GetNextToken();    // Consume the '+' or '-'
         Term();
+        EvaluateOperator(t.lexeme); // Semantic check - operand types
 
         // Code Generation
         if (t.lexeme == "+")
-            WriteCode("add");
+            WriteCode(VmInstruction::add);
         else
-            WriteCode("sub");
+            WriteCode(VmInstruction::sub);
 
         t = l.PeekNextToken();
     }
@@ -1298,18 +1868,15 @@ void Parser::Term() {
 
     Token t = l.PeekNextToken();
     while (t.lexeme == "*" || t.lexeme == "/") {
-        // Store Expressions for semantic checks
-        expression.push_back(t.lexeme);
-        arguments.push_back(t.lexeme);
-
         t = l.GetNextToken();    // Consume the '*' or '/'
         Factor();
+        EvaluateOperator(t.lexeme); // Semantic check - operand types
 
         // Code Generation
         if (t.lexeme == "*")
-            WriteCode("call Math.multiply 2");
+            WriteCall("Math.multiply", 2);
         else
-            WriteCode("call Math.divide 2");
+            WriteCall("Math.divide", 2);
 
         t = l.PeekNextToken();
     }
@@ -1324,9 +1891,9 @@ void Parser::Factor() {
 
         // Code Generation
         if (t.lexeme == "-")
-            WriteCode("neg");
+            WriteCode(VmInstruction::neg);
         else
-            WriteCode("not");
+            WriteCode(VmInstruction::NOT);
     }
     else
         Operand();
@@ -1336,12 +1903,11 @@ void Parser::Factor() {
 void Parser::Operand() {
     Token t = l.GetNextToken();
     if (t.type == t.constant) {
-        // Store Expressions for semantic checks
-        expression.push_back("int");
-        arguments.push_back("int");
+        // Store the type for semantic checks
+        typeStack.push_back(intType);
 
         // Code Generation
-        WriteCode("push constant " + t.lexeme);
+        WriteCode(VmInstruction::push, VmInstruction::constant, std::atoi(t.lexeme.c_str()));
     }
     else if (t.type == t.identifier) {
         std::string copy = t.lexeme;
@@ -1357,55 +1923,43 @@ void Parser::Operand() {
 
             // Semantic Check - store types to evaluate expressions
             std::string type;
-            if (symbolTables[currentSymbolTable].FindSymbol(t.lexeme)) { // Method table
-                 type = symbolTables[currentSymbolTable].GetSymbolType(t.lexeme);
-                 expression.push_back(type);
-                 arguments.push_back(type);
-            }
-            else if (symbolTables[currentSymbolTable-1].FindSymbol(t.lexeme)) { // Class table
+            if (symbolTables[currentSymbolTable].FindSymbol(t.lexeme)) // Method table
+                type = symbolTables[currentSymbolTable].GetSymbolType(t.lexeme);
+            else // Class table
                 type = symbolTables[currentSymbolTable - 1].GetSymbolType(t.lexeme);
-                expression.push_back(type);
-                arguments.push_back(type);
-            }
+            typeStack.push_back(InternType(type));
         }
 
         // Code Generation
         if (symbolTables[currentSymbolTable].FindSymbol(t.lexeme)) { // Method table
-            std::string offset = symbolTables[currentSymbolTable].GetSymbolOffset(t.lexeme);
+            int offset = std::stoi(symbolTables[currentSymbolTable].GetSymbolOffset(t.lexeme));
             Symbol::symbolKind k;
             k = symbolTables[currentSymbolTable].GetSymbolKind(t.lexeme);
             if (k == 0) // static variables
-                WriteCode("push static " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::STATIC, offset);
             else if (k == 1) // field variables
-                WriteCode("push this " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::THIS, offset);
             else if (k == 2) // argument variables
-                WriteCode("push argument " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::argument, offset);
             else if (k == 3) // local variables
-                WriteCode("push local " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::local, offset);
         }
         else if (symbolTables[currentSymbolTable-1].FindSymbol(t.lexeme)) { // Class table
-            std::string offset = symbolTables[currentSymbolTable-1].GetSymbolOffset(t.lexeme);
+            int offset = std::stoi(symbolTables[currentSymbolTable-1].GetSymbolOffset(t.lexeme));
             Symbol::symbolKind k;
             k = symbolTables[currentSymbolTable-1].GetSymbolKind(t.lexeme);
             if (k == 0) // static variables
-                WriteCode("push static " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::STATIC, offset);
             else if (k == 1) // field variables
-                WriteCode("push this " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::THIS, offset);
             else if (k == 2) // argument variables
-                WriteCode("push argument " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::argument, offset);
             else if (k == 3) // local variables
-                WriteCode("push local " + offset);
+                WriteCode(VmInstruction::push, VmInstruction::local, offset);
         }
 
-        // Semantic Check - Variable initialisation
-        if (symbolTables[currentSymbolTable].FindSymbol(t.lexeme)) { // Method table
-            if (!symbolTables[currentSymbolTable].IsInitialised(t.lexeme))
-                Warning(t, "Variable not initialised before being used.");
-        }
-        else if (symbolTables[currentSymbolTable-1].FindSymbol(t.lexeme)) { // Class table
-            if (!symbolTables[currentSymbolTable-1].IsInitialised(t.lexeme))
-                Warning(t, "Variable not initialised before being used.");
-        }
+        // Semantic Check - Variable initialisation, checked on the flow graph
+        FlowAccess(t, false);
 
         std::string identifier2;
         t = l.PeekNextToken();
@@ -1425,18 +1979,18 @@ void Parser::Operand() {
                     d.type = copy; // Store type before the '.' if its a constructor
                     d.name = t.lexeme;
                     subroutineCalls.push_back(d);
+                    classCalledNames[currentClass].insert(d.name);
 
-                    // Semantic check - store expressions for evaluation at the end
-                    expression.push_back(copy);
-                    arguments.push_back(copy);
+                    // Semantic check - store the type of the constructed object
+                    typeStack.push_back(InternType(copy));
                 }
                 else {
                     d.name = t.lexeme;
                     subroutineCalls.push_back(d);
+                    classCalledNames[currentClass].insert(d.name);
 
-                    // Semantic check - store expressions for evaluation at the end
-                    expression.push_back(t.lexeme);
-                    arguments.push_back(t.lexeme);
+                    // Semantic check - the return type is resolved at the end
+                    typeStack.push_back(InternCall(t.lexeme));
                 }
             }
             else
@@ -1447,20 +2001,18 @@ void Parser::Operand() {
         if (t.lexeme == "[") {
             l.GetNextToken();    // Consume the '['
 
-            // Turned out to be an ArrayEntry so delete last stored
-            expression.erase(expression.end()-1);
-            arguments.erase(arguments.end()-1);
-            expression.push_back("ArrayEntry");
-            arguments.push_back("ArrayEntry");
+            // Turned out to be an ArrayEntry so replace the type stored
+            typeStack.back() = arrayEntryType;
 
             Expression();
+            typeStack.pop_back(); // The index type isnt part of the expression
 
             t = l.GetNextToken();
             if (t.lexeme == "]") {
                 // Code Generation - Array access
-                WriteCode("add");
-                WriteCode("pop pointer 1");
-                WriteCode("push that 0");
+                WriteCode(VmInstruction::add);
+                WriteCode(VmInstruction::pop, VmInstruction::pointer, 1);
+                WriteCode(VmInstruction::push, VmInstruction::that, 0);
             }
             else
                 Error(t, "Expected a ']'.");
@@ -1468,11 +2020,7 @@ void Parser::Operand() {
         else if (t.lexeme == "(") {
             l.GetNextToken();    // Consume the '('
 
-            unsigned long resize = expression.size();
-            ExpressionList();
-            // After the 'ExpressionList' call the expressions might clash
-            // So we use resize to the original storage to keep the first expression
-            expression.resize(resize);
+            int nArgs = ExpressionList();
 
             t = l.GetNextToken();
             if (t.lexeme == ")")
@@ -1480,10 +2028,7 @@ void Parser::Operand() {
             else
                 Error(t, "Expected a ')'.");
 
-            // Code Generation
-            std::string numOfArgs = GetNumOfArgs(copy, identifier2);
-            int methodArgs = std::stoi(numOfArgs) + 1;
-            std::string methodNumOfArgs = std::to_string(methodArgs);
+            // Code Generation - methods get the object as an extra argument, nArgs + 1
 
             // Find the class the symbol belongs to and get it
             std::string type;
@@ -1493,13 +2038,15 @@ void Parser::Operand() {
                 type = symbolTables[currentSymbolTable-1].GetSymbolType(copy);
 
             if (identifier2.empty()) {
-                WriteCode("push pointer 0");
-                WriteCode("call " + currentClass + "." + copy + " " + methodNumOfArgs);
+                WriteCode(VmInstruction::push, VmInstruction::pointer, 0);
+                WriteCall(currentClass + "." + copy, nArgs + 1);
+            }
+            else if (type.empty()) {
+                AddDependency(copy); // Function or constructor of another class
+                WriteCall(copy + "." + identifier2, nArgs);
             }
-            else if (type.empty())
-                WriteCode("call " + copy + "." + identifier2 + " " + numOfArgs);
             else
-                WriteCode("call " + type + "." + identifier2 + " " + methodNumOfArgs);
+                WriteCall(type + "." + identifier2, nArgs + 1);
         }
     }
     else if (t.lexeme == "(") {
@@ -1512,38 +2059,33 @@ void Parser::Operand() {
             Error(t, "Expected a ')'.");
     }
     else if (t.type == t.string_literal) {
-        // Store Expressions for semantic checks
-        expression.push_back("String");
-        arguments.push_back("String");
+        // Store the type for semantic checks
+        typeStack.push_back(InternType("String"));
 
         // Code Generation
-        WriteCode("push constant " + std::to_string(t.lexeme.length()));
-        WriteCode("call String.new 1");
-        for (char &c: t.lexeme) {
-            WriteCode("push constant " + std::to_string(int(c)));
-            WriteCode("call String.appendChar 2");
+        if (poolStrings) {
+            WriteCode(VmInstruction::push, VmInstruction::STATIC, PoolLiteral(t.lexeme));
+            subroutineUsesLiterals = true;
         }
+        else
+            WriteString(t.lexeme);
     }
     else if (t.lexeme == "true") {
-        expression.push_back("boolean");
-        arguments.push_back("boolean");
-        WriteCode("push constant 1");
-        WriteCode("neg");
+        typeStack.push_back(booleanType);
+        WriteCode(VmInstruction::push, VmInstruction::constant, 1);
+        WriteCode(VmInstruction::neg);
     }
     else if (t.lexeme == "false") {
-        expression.push_back("boolean");
-        arguments.push_back("boolean");
-        WriteCode("push constant 0");
+        typeStack.push_back(booleanType);
+        WriteCode(VmInstruction::push, VmInstruction::constant, 0);
     }
     else if (t.lexeme == "null") {
-        expression.push_back("null");
-        arguments.push_back("null");
-        WriteCode("push constant 0");
+        typeStack.push_back(nullType);
+        WriteCode(VmInstruction::push, VmInstruction::constant, 0);
     }
     else if (t.lexeme == "this") {
-        expression.push_back(currentClass);
-        arguments.push_back(currentClass);
-        WriteCode("push pointer 0");
+        typeStack.push_back(InternType(currentClass));
+        WriteCode(VmInstruction::push, VmInstruction::pointer, 0);
     }
     else
         Error(t, "Unknown constant or variable.");
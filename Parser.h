@@ -3,8 +3,15 @@
 
 #include <iostream>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
 #include "CompilerHeaders.h"
 #include "SymbolTable.h"
+#include "FlowGraph.h"
+#include "VmCode.h"
+#include "Optimiser.h"
 
 /****************** Parser class definitions *****************/
 class Parser {
@@ -19,15 +26,39 @@ private:
     std::string currentSubroutineType;
     std::string currentSubroutineKind;
 
+    /* Types are interned and referred to by their index in typeNames. A negative id
+     * is the return type of a called subroutine (~id indexes calledNames), which is
+     * only known once every class has been parsed. */
+    typedef int TypeId;
+    std::vector <std::string> typeNames;
+    std::unordered_map <std::string, TypeId> typeIds;
+    std::vector <std::string> calledNames;
+    std::unordered_map <std::string, TypeId> calledIds;
+    std::vector <TypeId> resolvedCalls; // return type of each called name
+
+    /* The types the compatibility rules single out are interned first with fixed ids,
+     * any id from classType onwards is a class and compatible like every other class */
+    enum builtinType {noType, voidType, intType, charType, booleanType, nullType,
+                      arrayEntryType, arrayType, classType};
+    unsigned short compatibility[classType + 1]; // bit t2 of row t1 set if compatible
+
+    // An operator whose operand types could not be checked while parsing
+    typedef struct {
+        std::string op;
+        TypeId left;
+        TypeId right;
+    } operation;
+
     typedef struct {
         std::string filename;
         std::string type;
         std::string name;
         int lineNum;
-        std::string LHS;
-        std::string RHS;
+        TypeId LHS = noType; // type assigned or returned to
+        TypeId exprType = noType; // type the expression evaluates to
         bool resolved = false;
-        std::vector <std::string> arguments; // for subroutines
+        std::vector <TypeId> arguments; // for subroutines, the type of each argument
+        std::vector <operation> operations; // operators to check once types are resolved
         bool argsMatch = false; // for subroutines
     } declaration;
     std::vector <declaration> varDeclarations; // for resolving variables from other classes
@@ -35,13 +66,64 @@ private:
     std::vector <declaration> assignments; // for evaluating LHS, RHS compatibility
     std::vector <declaration> returns; // for evaluating subroutine return expressions
     std::vector <declaration> arrayIndices; // for evaluating array indices expressions
+
+    // Hash index of the program SymbolTable, built once and only read when checking
+    typedef std::unordered_map <std::string, const Symbol*> SymbolIndex;
+    SymbolIndex members; // First subroutine, field or static with a given name
+    SymbolIndex calls; // Keyed by 'name' or 'type.name', with and without '/nArgs'
+    std::unordered_set <std::string> classNames;
+    /* Classes whose objects are assigned, passed or returned as another type, they could
+     * be read as an array so the optimiser keeps their fields where they are */
+    std::unordered_set <TypeId> aliasedTypes;
+
+    // An error or warning found while checking, printed once every shard is done
+    typedef struct {
+        std::string filename;
+        int lineNum;
+        int list; // The declaration list and position, orders diagnostics on a line
+        unsigned long position;
+        bool error;
+        std::string message;
+    } diagnostic;
+
+    // Each thread checks one shard, a slice of every declaration list
+    typedef struct {
+        unsigned int index;
+        unsigned int count;
+        int list; // Declaration being checked
+        unsigned long position;
+        std::vector <diagnostic> diagnostics;
+        std::vector <TypeId> aliasedTypes; // Merged once every shard is done
+    } shard;
     bool foundIfReturn;
     bool foundElseReturn; // Used for all code paths check
-    /* Used to temporarily store expressions as they are parsed until the expression is
-     * complete, then its placed in one of the declarations where it belongs. There are
-     * 2 containers because subroutines may call expressionlist and then expressions would clash */
-    std::vector <std::string> expression;
-    std::vector <std::string> arguments;
+    /* Expression types are evaluated bottom-up as they are parsed, every operand pushes
+     * its type and every operator pops both sides and pushes the type it evaluates to,
+     * so a complete expression leaves exactly one type on the stack. */
+    std::vector <TypeId> typeStack;
+    std::vector <operation> operations;
+
+    // Class dependency graph, the classes each class references while parsing
+    std::string currentSourceFile;
+    std::map <std::string, std::string> classSources; // class name to its .jack path
+    std::map <std::string, std::string> classOutputs; // program class name to its VM file
+    std::map <std::string, std::set<std::string>> classDependencies;
+    std::map <std::string, std::set<std::string>> classCalledNames;
+    // Position of each class entries in the program SymbolTable
+    std::map <std::string, std::pair<unsigned long, unsigned long>> classSymbolRanges;
+
+    FlowGraph flow; // Of the subroutine being parsed, for the flow sensitive checks
+
+    // Names of the functions the VM code calls, instructions refer to them by index
+    std::vector <std::string> vmNames;
+    std::unordered_map <std::string, int> vmNameIds;
+    // Parameters of each subroutine by its name id, 'this' counts for methods
+    std::unordered_map <int, int> subroutineParameters;
+
+    // String literals of the class being parsed, each kept in a hidden static
+    std::vector <std::pair<std::string, int>> classLiterals;
+    std::unordered_map <std::string, int> classLiteralStatics;
+    bool subroutineUsesLiterals;
 
     // For creating labels for code generation
     int labelCounter = 0;
@@ -49,43 +131,81 @@ private:
 
 public:
     Parser();
+    bool poolStrings = false; // Keep string literals in statics rather than building them each time
     bool Init(std::string filename);
     void ClassDeclar();
 
     // Used for Semantics checking
     void AddJackOS();
     void ResolveAllDeclars();
+    void Optimise(Optimiser &optimiser, bool wholeProgram);
 
     // Output vm files
     typedef struct {
         std::string filename;
-        std::vector <std::string> vmCode;
+        std::vector <VmInstruction> vmCode;
     } VmFile;
     std::vector <VmFile> vmFiles;
     void WriteVmFiles(std::string path);
+    void WriteBundle(std::string filename);
+    void WriteDepFile(std::string filename, std::string path);
+    void WriteDependencyJson(std::string filename, std::string path);
+
+    // Used for incremental compilation, see BuildState
+    std::string CompileClass(std::string filename, std::string filePath);
+    void RestoreClass(std::string filename, std::string filePath, std::string className,
+                      const std::vector<Symbol> &symbols,
+                      const std::set<std::string> &dependencies,
+                      const std::set<std::string> &calledNames);
+    void RecompileClass(std::string filename, std::string filePath, std::string className);
+    std::vector <Symbol> ClassSymbols(std::string className);
+    std::set <std::string> ClassDependencies(std::string className);
+    std::set <std::string> ClassCalledNames(std::string className);
+    std::unordered_map <std::string, std::string> MemberTypes();
 
 // Encapsulate these as they should never be called randomly
 private:
     // Used for Semantics checking
-    void ResolveVarDeclar(std::string type);
-    void ResolveSubroutineCall(Symbol s);
-    void ResolveSubroutinesReturnType(std::vector<declaration> &v, Symbol s);
-    void EvaluateExpressions(std::vector<declaration> &v);
-    bool CheckCompatibility(std::string type1, std::string type2);
-    void CheckReturnsCompatibility();
-    void CheckArrayIndices();
+    void BuildSymbolIndex();
+    void CheckShard(shard &s);
+    void ResolveVarDeclar(shard &s, declaration &d);
+    void ResolveSubroutineCall(shard &s, declaration &d);
+    void ResolveSubroutinesReturnType();
+    void EvaluateExpression(shard &s, declaration &d);
+    TypeId InternType(const std::string &name);
+    TypeId InternCall(const std::string &name);
+    TypeId ResolveType(TypeId type);
+    const std::string &TypeName(TypeId type);
+    void EvaluateOperator(const std::string &op);
+    TypeId PopExpression(declaration &d, unsigned long mark);
+    void BuildCompatibility();
+    bool CheckCompatibility(TypeId type1, TypeId type2);
+    void CheckAliasing(shard &s, TypeId target, TypeId value);
+    void CheckAssignmentCompatibility(shard &s, declaration &d);
+    void CheckReturnCompatibility(shard &s, declaration &d);
+    void CheckArrayIndex(shard &s, declaration &d);
 
     // Error and Warnings reporting
     void Error(Token t, std::string message);
     void Warning(Token t, std::string message);
-    void ResolveError(declaration d, std::string message);
-    void ResolveWarning(declaration d, std::string message);
+    void ResolveError(shard &s, const declaration &d, const std::string &message);
+    void ResolveWarning(shard &s, const declaration &d, const std::string &message);
+    void ReportDiagnostics(std::vector<shard> &shards);
+    void FlowAccess(Token t, bool write);
 
     // Used for Code Generation
-    void WriteCode(std::string vmCode);
-    void RemovePopCode(Symbol s);
-    std::string CreateLabel();
-    std::string GetNumOfArgs(std::string name, std::string type);
+    void WriteCode(VmInstruction::opcode op,
+                   VmInstruction::segmentName segment = VmInstruction::constant, int index = 0);
+    void WriteCode(VmInstruction::opcode op, int operand);
+    void WriteCall(const std::string &function, int nArgs);
+    int InternName(const std::string &name);
+    void AppendInstruction(std::string &buffer, const VmInstruction &i);
+    void RemovePopCode();
+    int CreateLabel();
+    void WriteString(const std::string &literal);
+    int PoolLiteral(const std::string &literal);
+    void WriteLiteralPool();
+    void AddDependency(const std::string &className);
 
     // Productions functions for the parser
     void MemberDeclar();
@@ -101,7 +221,7 @@ private:
     void WhileStatement();
     void DoStatement();
     void SubroutineCall();
-    void ExpressionList();
+    int ExpressionList();
     void ReturnStatement();
     void Expression();
     void RelationalExpression();
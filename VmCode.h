@@ -0,0 +1,23 @@
+#ifndef VMCODE_H
+#define VMCODE_H
+
+/****************** VmInstruction class definitions *****************/
+/* One VM instruction in 8 bytes. Function names are interned by the Parser and
+ * labels are numbered, the text is only produced when the VM files are written. */
+class VmInstruction {
+public:
+    enum opcode : unsigned char {push, pop, add, sub, neg, eq, gt, lt, AND, OR, NOT,
+                                 label, GOTO, ifGoto, function, call, RETURN,
+                                 callee}; // callee marks the name called by a 'do'
+    enum segmentName : unsigned char {constant, argument, local, STATIC, THIS, that,
+                                      pointer, temp};
+    // Names interned first with fixed ids, the optimiser rewrites calls to them
+    enum builtinName {multiply, divide, alloc};
+
+    opcode op;
+    segmentName segment;
+    unsigned short count; // Arguments of a call or locals of a function
+    int operand; // Segment index, label number or name id
+};
+
+#endif
@@ -1,42 +1,101 @@
 #include <iostream>
+#include <chrono>
 #include <sys/stat.h>
 #include <dirent.h>
 #include "CompilerHeaders.h"
 
 int main(int argc, char *argv[]) {
-    // In C/C++ argc is 1 if nothing is passed because argv[0] contains the program name
-    if (argc == 2) {
+    /* Options for the class dependency graph, -MD writes a Make/Ninja depfile
+     * (to deps.d in the output directory unless -MF names it), --deps-json a JSON file.
+     * --build-state keeps the state of the build in a directory so only the classes
+     * that changed, or that depend on an interface that changed, are compiled again.
+     * --bundle writes the whole program to one file, or to stdout if it is '-'.
+     * -O0 turns the VM code optimisations off and --stats prints what they did.
+     * --pool-strings builds each string literal once and shares it, which changes what
+     * programs that modify or dispose of a literal do, so it is never on by default.
+     * --whole-program allows the optimisations that need to see every class, like
+     * leaving out the subroutines nothing calls. --time prints how long parsing,
+     * resolving and optimising took, in microseconds */
+    std::string path, depFile, jsonFile, stateDir, bundleFile;
+    bool writeDepFile = false, optimise = true, printStats = false, wholeProgram = false;
+    bool printTimes = false, poolStrings = false;
+    int nPaths = 0;
+    for (int i=1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-MD")
+            writeDepFile = true;
+        else if (arg == "-MF" && i+1 < argc) {
+            writeDepFile = true;
+            depFile = argv[++i];
+        }
+        else if (arg == "--deps-json" && i+1 < argc)
+            jsonFile = argv[++i];
+        else if (arg == "--build-state" && i+1 < argc)
+            stateDir = argv[++i];
+        else if (arg == "--bundle" && i+1 < argc)
+            bundleFile = argv[++i];
+        else if (arg == "-O0")
+            optimise = false;
+        else if (arg == "--pool-strings")
+            poolStrings = true;
+        else if (arg == "--stats")
+            printStats = true;
+        else if (arg == "--whole-program")
+            wholeProgram = true;
+        else if (arg == "--time")
+            printTimes = true;
+        else {
+            path = arg;
+            nPaths++;
+        }
+    }
+
+    /* The bundle holds every class, so none can be restored from a previous build, and
+     * the whole program passes need the code of every class */
+    if (!bundleFile.empty() || wholeProgram)
+        stateDir.clear();
+    // Keep stdout for the bundle, the warnings and errors go to stderr instead
+    if (bundleFile == "-")
+        std::cout.rdbuf(std::cerr.rdbuf());
+
+    if (nPaths == 1) {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start = Clock::now();
         Parser parser;
-        std::string path = argv[1];
+        parser.poolStrings = poolStrings;
         struct stat status;
+        BuildState *buildState = nullptr;
+        if (!stateDir.empty()) {
+            std::string options = std::string("optimise ") + (optimise ? "1" : "0") +
+                                  " pool " + (poolStrings ? "1" : "0");
+            buildState = new BuildState(stateDir, options);
+        }
 
         // Check if its a valid path
-        if (stat(argv[1], &status) == 0) {
+        if (stat(path.c_str(), &status) == 0) {
             if (status.st_mode & S_IFDIR) { // If its a directory
                 DIR *dir;
                 struct dirent *jackFile;
-                if ((dir = opendir(argv[1])) != nullptr) {
-                    parser.AddJackOS();
+                if ((dir = opendir(path.c_str())) != nullptr) {
+                    std::vector <std::string> filenames;
                     while ((jackFile = readdir(dir)) != nullptr) {
                         std::string filename = jackFile->d_name;
                         if (filename.substr(filename.find_last_of(".") + 1) == "jack") {
                             // Extract the filename without the extension
-                            std::string withoutExtension;
-                            withoutExtension = filename.substr(0, filename.find_last_of("."));
-
-                            // Create VmFile object and add it to the list
-                            Parser::VmFile file;
-                            file.filename = withoutExtension;
-                            parser.vmFiles.push_back(file);
-
-                            std::string filePath = path + '/' + filename;
-                            bool init = parser.Init(filePath);
-                            if (init) {
-                                parser.ClassDeclar();
-                            }
+                            filenames.push_back(filename.substr(0, filename.find_last_of(".")));
                         }
                     }
                     closedir(dir);
+
+                    parser.AddJackOS();
+                    if (buildState) {
+                        buildState->Load();
+                        buildState->Compile(parser, path, filenames);
+                    }
+                    else {
+                        for (std::string filename: filenames)
+                            parser.CompileClass(filename, path + '/' + filename + ".jack");
+                    }
                 }
                 else { // Could not open directory
                     std::cout << "Couldn't open directory " << path << std::endl;
@@ -74,10 +133,35 @@ int main(int argc, char *argv[]) {
             std::cout << "No such file or directory " << path << std::endl;
 
         // Once all the parsing is done resolve everything and check
+        Clock::time_point parsed = Clock::now();
         parser.ResolveAllDeclars();
+        Clock::time_point resolved = Clock::now();
+        Optimiser optimiser;
+        if (optimise)
+            parser.Optimise(optimiser, wholeProgram);
+        Clock::time_point optimised = Clock::now();
+        if (printTimes) {
+            typedef std::chrono::microseconds us;
+            std::cout << "parse: " << std::chrono::duration_cast<us>(parsed - start).count() << " us\n"
+                      << "resolve: " << std::chrono::duration_cast<us>(resolved - parsed).count() << " us\n"
+                      << "optimise: " << std::chrono::duration_cast<us>(optimised - resolved).count() << " us" << std::endl;
+        }
+        if (printStats)
+            optimiser.PrintStats();
 
         // Both the compilation and checks are complete, write the VM files now
-        parser.WriteVmFiles(path);
+        if (bundleFile.empty())
+            parser.WriteVmFiles(path);
+        else
+            parser.WriteBundle(bundleFile);
+        if (writeDepFile)
+            parser.WriteDepFile(depFile.empty() ? path + "/deps.d" : depFile, path);
+        if (!jsonFile.empty())
+            parser.WriteDependencyJson(jsonFile, path);
+        if (buildState) {
+            buildState->Save(parser);
+            delete buildState;
+        }
     }
     else
         std::cout << "Please pass only one JACK file or folder path." << std::endl;
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Writes a Jack program of N classes to a directory, for timing how the compiler
+# scales. Each class uses the next one, so every class has dependencies to resolve.
+# Usage: generate.sh N directory
+n=$1
+dir=$2
+mkdir -p "$dir"
+rm -f "$dir"/*.jack "$dir"/*.vm
+
+i=0
+while [ "$i" -lt "$n" ]; do
+    next=C$(( (i + 1) % n ))
+    cat > "$dir/C$i.jack" <<JACK
+class C$i {
+    field int a, b;
+    field $next peer;
+    static int made;
+
+    constructor C$i new(int x, int y) {
+        let a = x;
+        let b = y;
+        let made = made + 1;
+        return this;
+    }
+
+    method int getA() {
+        return a;
+    }
+
+    method void link($next p) {
+        let peer = p;
+        return;
+    }
+
+    method int work(int k) {
+        var int i, s;
+        let i = 0;
+        let s = 0;
+        while (i < k) {
+            let s = s + (a * i) + peer.getA();
+            let i = i + 1;
+        }
+        return s;
+    }
+
+    function int helper$i(int q) {
+        return (q * 3) + C$i.count() + $next.count();
+    }
+
+    function int count() {
+        return made;
+    }
+}
+JACK
+    i=$((i + 1))
+done
+
+cat > "$dir/Main.jack" <<JACK
+class Main {
+    function void main() {
+        var C0 c;
+        let c = C0.new(1, 2);
+        do Output.printInt(C0.helper0(c.work(3)));
+        return;
+    }
+}
+JACK
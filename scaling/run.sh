@@ -0,0 +1,26 @@
+#!/bin/sh
+# Times the resolve phase of the compiler on generated programs of 100, 1k and 10k
+# classes. Resolving is meant to be linear in the size of the program, so it fails
+# if ten times the classes takes more than thirty times as long.
+# Usage: run.sh path/to/compiler [work directory]
+compiler=$1
+work=${2:-${TMPDIR:-/tmp}/jack-scaling}
+here=$(dirname "$0")
+
+previous=0
+status=0
+for n in 100 1000 10000; do
+    sh "$here/generate.sh" "$n" "$work/$n"
+    micros=$("$compiler" -O0 --time "$work/$n" | sed -n 's/^resolve: \([0-9]*\) us$/\1/p')
+    if [ -z "$micros" ]; then
+        echo "$n classes: the compiler did not report the resolve time"
+        exit 1
+    fi
+    echo "$n classes: resolve took $micros us"
+    if [ "$previous" -gt 0 ] && [ "$micros" -gt $((previous * 30)) ]; then
+        echo "  more than 30 times the time for 10 times the classes"
+        status=1
+    fi
+    previous=$micros
+done
+exit $status
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Compiles the programs in tests and checks the VM code the optimiser leaves for them.
+# Run from the compiler directory, it reads JackOS from there.
+# Usage: check.sh path/to/compiler
+compiler=$1
+here=$(dirname "$0")
+status=0
+
+# tailCall program function nArgs, if the VM code has 'call function nArgs; return'
+tailCall() {
+    grep -A1 "^call $2 $3\$" "$here/$1/Main.vm" | grep -q "^return\$"
+}
+fail() {
+    echo "$1"
+    status=1
+}
+
+for options in "" "--whole-program"; do
+    "$compiler" $options "$here/tailcalls" > /dev/null
+    tailCall tailcalls Main.sum 2 && fail "tailcalls ${options:-default}: the tail call of sum is not looped"
+    tailCall tailcalls Main.extra 3 || fail "tailcalls ${options:-default}: extra loops with one argument too many"
+    tailCall tailcalls Main.fewer 1 || fail "tailcalls ${options:-default}: fewer loops with one argument missing"
+    rm -f "$here"/tailcalls/*.vm
+done
+
+[ "$status" -eq 0 ] && echo "All checks passed"
+exit $status